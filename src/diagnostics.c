@@ -25,6 +25,8 @@
 
 #include "btn.h"
 #include "elm327.h"
+#include "fmt.h"
+#include "hud_data.h"
 #include "layout.h"
 #include "menu.h"
 #include "obd_pid.h"
@@ -32,6 +34,22 @@
 #include "utl.h"
 #include "vfd.h"
 
+#define FMT_BENCH_CNT (1000)
+#define BURST_SHOW_INTVL (200)
+
+/*
+ * Precision and units of the PIDs that can be burst sampled
+ */
+static const struct {
+    obd_pid_t8 pid;
+    uint8_t prec;
+    char const *units;
+} burst_pids[] = {
+    {   OBD_PID_INTAKE_ABS_PRES,    0,  "kPa"   },
+    {   OBD_PID_ENGN_RPM,           0,  "RPM"   },
+    {   OBD_PID_MAF_RATE,           2,  "g/s"   },
+};
+
 static bool
 test_btn_process(uint8_t btn)
 {
@@ -113,6 +131,46 @@ done:
     return MENU_NONE;
 }
 
+/*
+ * Measures the average number of CPU cycles taken to format a value, using
+ * the fixed point formatter and snprintf() for comparison
+ */
+static enum menu_id
+fmt_diagnostics_menu(enum menu_id id, void *param)
+{
+    uint16_t i;
+    uint32_t start;
+    uint32_t fmt_time;
+    uint32_t printf_time;
+    char buf[6];
+
+    VFD_soft_reset();
+    VFD_char_width(VFD_CHAR_WDTH_FIXED_1);
+    VFD_printf("Running...");
+
+    start = timer_get();
+    for (i = 0; i < FMT_BENCH_CNT; i++)
+        FMT_fixed(buf, sizeof(buf), -(int32_t)i, 1, 0, 0);
+    fmt_time = timer_get() - start;
+
+    start = timer_get();
+    for (i = 0; i < FMT_BENCH_CNT; i++)
+        snprintf(buf, sizeof(buf), "%ld.%ld", -(int32_t)i / 10,
+                (int32_t)i % 10);
+    printf_time = timer_get() - start;
+
+    VFD_clear();
+    VFD_printf("Fmt: %lu cyc", fmt_time * (F_CPU / 1000) / FMT_BENCH_CNT);
+    VFD_set_cursor(0, 1);
+    VFD_printf("printf: %lu cyc",
+            printf_time * (F_CPU / 1000) / FMT_BENCH_CNT);
+
+    BTN_wait(10000);
+
+    VFD_soft_reset();
+    return MENU_NONE;
+}
+
 static enum menu_id
 show_pid_menu(enum menu_id id, void *param)
 {
@@ -186,12 +244,86 @@ pid_menu(enum menu_id id, void *param)
     return (m == MENU_TIMEOUT) ? m : MENU_NONE;
 }
 
+/*
+ * Polls a single PID as fast as possible until a button is pressed, then shows
+ * the maximum and average values and the sample rate that was achieved
+ */
+static enum menu_id
+burst_proc(enum menu_id id, void *param)
+{
+    uint8_t b = id;
+    struct hud_burst_summary summary;
+    uint32_t shown;
+    uint16_t time;
+    int32_t value;
+    char max[8];
+    char avg[8];
+
+    VFD_soft_reset();
+    VFD_char_width(VFD_CHAR_WDTH_FIXED_1);
+    VFD_printf("Bursting...");
+    VFD_set_cursor(0, 1);
+    VFD_printf("Press to stop");
+
+    HUD_burst_start(burst_pids[b].pid);
+    shown = timer_get();
+
+    while (!BTN_process()) {
+        HUD_process();
+
+        if (timer_get() - shown >= BURST_SHOW_INTVL &&
+                HUD_burst_get(0, &time, &value)) {
+            FMT_fixed(avg, sizeof(avg), value, burst_pids[b].prec, 0, 0);
+            VFD_clear();
+            VFD_printf("%s %s", avg, burst_pids[b].units);
+            shown = timer_get();
+        }
+    }
+
+    HUD_burst_stop(&summary);
+
+    FMT_fixed(max, sizeof(max), summary.max, burst_pids[b].prec, 0, 0);
+    FMT_fixed(avg, sizeof(avg), summary.avg, burst_pids[b].prec, 0, 0);
+
+    VFD_clear();
+    VFD_printf("Max %s Avg %s", max, avg);
+    VFD_set_cursor(0, 1);
+    VFD_printf("%u smp, %u.%u Hz", summary.cnt, summary.rate / 10,
+            summary.rate % 10);
+
+    BTN_wait(10000);
+
+    VFD_soft_reset();
+    return MENU_NONE;
+}
+
+static enum menu_id
+burst_menu(enum menu_id id, void *param)
+{
+    static const struct menu_type menu[] = {
+        {   0,          "MAP",      burst_proc  },
+        {   1,          "RPM",      burst_proc  },
+        {   2,          "MAF",      burst_proc  },
+        {   MENU_BACK,  "Back",     NULL        },
+    };
+
+    enum menu_id m;
+
+    STATIC_ASSERT(cnt_of_array(menu) == cnt_of_array(burst_pids) + 1);
+
+    m = menu_process(&layout_4, menu, cnt_of_array(menu), 0, NULL);
+
+    return (m == MENU_TIMEOUT) ? m : MENU_NONE;
+}
+
 enum menu_id
 diagnostics_menu(enum menu_id id, void *param)
 {
     static const struct menu_type menu[] = {
         {   MENU_NONE,  "Display",  display_diagnostics_menu    },
         {   MENU_NONE,  "PID",      pid_menu                    },
+        {   MENU_NONE,  "Fmt",      fmt_diagnostics_menu        },
+        {   MENU_NONE,  "Burst",    burst_menu                  },
         {   MENU_BACK,  "Back",     NULL                        },
     };
 
@@ -19,6 +19,7 @@
  * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
  * IN THE SOFTWARE.
  */
+#include <avr/io.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -52,12 +53,44 @@
 #endif
 
 #define LINE_BUFFER_SZ  (50)
+#define STAGE_BUFFER_SZ (2 + 2 * ELM327_MAX_PIDS + sizeof(ENDL))
+
+/*
+ * Period over which the time the ELM spends idle at the prompt is measured
+ */
+#define IDLE_WINDOW (1000)
 
 #define TIMEOUT (10000)
 
 #define RTS_PIN PIN_C2
 #define POWER_CTRL_PIN PIN_C1
 
+/*
+ * Minimum gap between the end of a response and the next request on the K-line
+ * protocols (P3 min from ISO 9141-2 and ISO 14230-4)
+ */
+#define KLINE_P3_MIN (55)
+
+/*
+ * Interval between wakeup messages sent by the ELM on the K-line protocols, in
+ * units of 20.48 ms. The ECU drops the session if it doesn't see a message for
+ * P3 max (5 seconds), so this keeps a comfortable margin (~2 seconds)
+ */
+#define KLINE_WAKEUP_INTVL (0x62)
+
+/*
+ * Limits for the delay between connection attempts after the vehicle fails to
+ * respond. The cap is kept short so that polling resumes within a second of
+ * the bus waking up (e.g. the ignition being turned on)
+ */
+#define BACKOFF_MIN (100)
+#define BACKOFF_MAX (750)
+
+#define proto_is_K_line(_p)    \
+    (((_p) == ELM327_PROTO_ISO_9141_2) ||    \
+     ((_p) == ELM327_PROTO_ISO_14230_4_KWP_SLOW) ||    \
+     ((_p) == ELM327_PROTO_ISO_14230_4_KWP_FAST))
+
 #define proto_is_ISO_15765(_p)    \
     (((_p) == ELM327_PROTO_ISO_15765_4_CAN_11_500_KBAUD) ||    \
      ((_p) == ELM327_PROTO_ISO_15765_4_CAN_29_500_KBAUD) ||    \
@@ -66,6 +99,18 @@
 
 static const char endl[] = ENDL;
 
+/*
+ * Responses indicating that the ELM could not talk to the vehicle
+ */
+static const char *const link_errors[] = {
+    "UNABLE TO CONNECT",
+    "BUS ERROR",
+    "BUS BUSY",
+    "CAN ERROR",
+    "FB ERROR",
+    "ERR94"
+    };
+
 static const char *const dtc_prefix[] = {
     /* 0    */  "P0",
     /* 1    */  "P1",
@@ -86,14 +131,34 @@ static const char *const dtc_prefix[] = {
     };
 
 static bool s_searching;
-static bool s_cannot_connect;
+static ELM327_link_state_type s_link_state;
+static uint16_t s_backoff;
+static uint16_t s_backoff_intvl;
+static uint32_t s_backoff_start;
 static ELM327_proto_type s_cur_proto;
 static char s_cur_proto_str[50];
 static bool s_auto_proto;
 
 static bool s_elm_ready;
+static uint32_t s_ready_time;
+static uint8_t s_min_gap;
+static bool s_link_cfg_pending;
 
 static uint8_t last_pid;
+static uint8_t last_pid_cnt;
+static bool s_rqst_pending;
+static uint32_t s_rqst_time;
+static bool s_repeatable;
+static obd_pid_t8 s_cmplt_pid;
+
+static bool s_staged;
+static obd_pid_t8 s_staged_pid;
+static uint8_t s_staged_cnt;
+static char s_staged_cmd[STAGE_BUFFER_SZ];
+
+static uint32_t s_idle_start;
+static uint16_t s_idle_accum;
+static uint16_t s_idle_time;
 
 static ELM327_data_clbk my_data_clbk;
 static ELM327_no_data_clbk my_no_data_clbk;
@@ -103,13 +168,26 @@ static void
 reset_state(void)
 {
     s_searching = false;
-    s_cannot_connect = false;
+    s_link_state = ELM327_LINK_UP;
+    s_backoff = 0;
     s_cur_proto = ELM327_PROTO_AUTO;
     s_cur_proto_str[0] = '\0';
     s_auto_proto = true;
     last_pid = 0;
+    last_pid_cnt = 0;
+    s_rqst_pending = false;
+    s_rqst_time = 0;
+    s_repeatable = false;
+    s_cmplt_pid = OBD_PID_CNT;
+    s_staged = false;
+    s_idle_start = timer_get();
+    s_idle_accum = 0;
+    s_idle_time = 0;
     my_echo_enabled = true;
     s_elm_ready = false;
+    s_ready_time = 0;
+    s_min_gap = 0;
+    s_link_cfg_pending = false;
 }
 
 static uint8_t
@@ -134,6 +212,67 @@ read_data(uint8_t *buffer, uint8_t size)
     return cur;
 }
 
+static void
+add_idle_time(uint32_t idle)
+{
+    uint32_t now = timer_get();
+
+    s_idle_accum += minval(idle, IDLE_WINDOW);
+
+    if (now - s_idle_start >= IDLE_WINDOW) {
+        s_idle_time = minval(s_idle_accum, IDLE_WINDOW);
+        s_idle_accum = 0;
+        s_idle_start = now;
+    }
+}
+
+/*
+ * Handles a prompt from the ELM. If a request was staged, it was (or is now)
+ * sent in response to this prompt, so the ELM remains busy
+ */
+static void
+process_prompt(void)
+{
+    bool dispatched = false;
+
+    if (s_rqst_pending) {
+        s_cmplt_pid = last_pid;
+        s_rqst_pending = false;
+    }
+
+    if (s_staged) {
+        s_staged = false;
+
+        if (!UART_tx_on_trigger_cncl(UART)) {
+            /*
+             * The UART already sent the request when the prompt arrived
+             */
+            add_idle_time(0);
+            s_rqst_time = UART_rx_trigger_time(UART);
+            dispatched = true;
+        } else if (s_link_state != ELM327_LINK_BACKOFF) {
+            /*
+             * The prompt arrived before the request was staged, or the TX
+             * queue had no room for it. Send it now
+             */
+            write_data(s_staged_cmd, strlen(s_staged_cmd));
+            add_idle_time(timer_get() - UART_rx_trigger_time(UART));
+            s_rqst_time = timer_get();
+            dispatched = true;
+        }
+    }
+
+    if (dispatched) {
+        last_pid = s_staged_pid;
+        last_pid_cnt = s_staged_cnt;
+        s_rqst_pending = true;
+        s_repeatable = true;
+    } else {
+        s_elm_ready = true;
+        s_ready_time = UART_rx_trigger_time(UART);
+    }
+}
+
 static char const *
 get_data(void)
 {
@@ -143,16 +282,22 @@ get_data(void)
     static uint8_t s_line_buffer_sz = 0;
 
     bool process;
+    bool done;
     uint8_t read_sz;
 
     process = false;
+    done = false;
 
     read_sz = read_data((void *)&s_line_buffer[s_line_buffer_sz],
             LINE_BUFFER_SZ - s_line_buffer_sz);
 
     s_line_buffer_sz += read_sz;
 
-    if (s_line_buffer_cur < s_line_buffer_sz) {
+    /*
+     * Scan everything that has been received up to the end of the next line or
+     * prompt, so that a response is handled on the first call after it arrives
+     */
+    while (!process && !done && s_line_buffer_cur < s_line_buffer_sz) {
         switch (s_line_buffer[s_line_buffer_cur]) {
         case '\n':
         case '\r':
@@ -174,6 +319,11 @@ get_data(void)
 
                 process = true;
                 printf("got newline" ENDL);
+            } else {
+                /*
+                 * Wait for more data
+                 */
+                done = true;
             }
             break;
 
@@ -181,7 +331,8 @@ get_data(void)
             s_line_buffer_sz--;
             memmove(&s_line_buffer[s_line_buffer_cur],
                     &s_line_buffer[s_line_buffer_cur + 1], s_line_buffer_sz);
-            s_elm_ready = true;
+            process_prompt();
+            done = true;
             printf("ELM327 Ready" ENDL);
             break;
 
@@ -293,6 +444,16 @@ wake_up(void)
     pin_set_output(RTS_PIN, PIN_HIGH);
 }
 
+/*
+ * Cancels a staged request if it hasn't already been sent
+ */
+static void
+unstage(void)
+{
+    if (s_staged && UART_tx_on_trigger_cncl(UART))
+        s_staged = false;
+}
+
 static void
 wait_ready(void)
 {
@@ -302,21 +463,100 @@ wait_ready(void)
     }
 }
 
+static void
+link_up(void)
+{
+    s_searching = false;
+    s_link_state = ELM327_LINK_UP;
+    s_backoff = 0;
+}
+
+/*
+ * Called when the vehicle fails to respond. Rather than immediately sending
+ * another request (which would tie up the ELM for another full search and
+ * timeout), wait for an exponentially increasing interval. A random jitter of
+ * up to 1/4 of the interval is added so that retries don't line up with
+ * periodic bus activity
+ */
+static void
+link_down(void)
+{
+    s_searching = false;
+
+    if (s_backoff == 0)
+        s_backoff = BACKOFF_MIN;
+    else
+        s_backoff = minval(s_backoff * 2, BACKOFF_MAX);
+
+    s_backoff_intvl = s_backoff + rand() % (s_backoff / 4 + 1);
+    s_backoff_start = timer_get();
+    s_link_state = ELM327_LINK_BACKOFF;
+}
+
+/*
+ * Returns true if a request may be sent on the link. Moves out of the backoff
+ * state once the backoff interval has expired
+ */
+static bool
+link_ready(void)
+{
+    if (s_link_state == ELM327_LINK_BACKOFF) {
+        if (timer_get() - s_backoff_start < s_backoff_intvl)
+            return false;
+
+        s_link_state = ELM327_LINK_RETRY;
+    }
+
+    return true;
+}
+
+static bool
+is_link_error(char const *buf)
+{
+    uint8_t i;
+
+    for (i = 0; i < cnt_of_array(link_errors); i++) {
+        if (strcmp(buf, link_errors[i]) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Returns true if enough time has passed since the last prompt to satisfy the
+ * inter-message gap required by the current protocol
+ */
+static bool
+paced(void)
+{
+    return timer_get() - s_ready_time >= s_min_gap;
+}
+
 static char const *
 send_command(char const *cmd, bool wait)
 {
     char const *result;
 
     result = NULL;
+    s_repeatable = false;
+
+    unstage();
 
     /*
      * Wait until the ELM327 is ready
      */
     wait_ready();
 
+    while (!paced())
+        ;
+
+    add_idle_time(timer_get() - s_ready_time);
+
     write_string(cmd);
     write_string(endl);
     s_elm_ready = false;
+    s_rqst_time = timer_get();
 
     if (my_echo_enabled) {
         while(get_data() == NULL)
@@ -367,12 +607,48 @@ get_proto(void)
     }
 }
 
+/*
+ * Configures the ELM for the protocol that was negotiated with the vehicle. On
+ * the K-line protocols the ELM is told to keep the session alive with periodic
+ * wakeup messages, so that pauses in polling (e.g. while the menu is open)
+ * don't drop the session and force a multi-second bus init on the next request
+ */
+static void
+configure_link(void)
+{
+    char cmd[10];
+    ELM327_proto_type proto;
+
+    s_link_cfg_pending = false;
+
+    proto = ELM327_get_proto();
+
+    if (proto_is_K_line(proto)) {
+        s_min_gap = KLINE_P3_MIN;
+
+        snprintf(cmd, sizeof(cmd), "at sw %02x", KLINE_WAKEUP_INTVL);
+        send_command(cmd, true);
+
+        /*
+         * Use the same messages the ELM would by default, but set them
+         * explicitly in case something else changed them
+         */
+        if (proto == ELM327_PROTO_ISO_9141_2)
+            send_command("at wm 68 6a f1 01 00", true);
+        else
+            send_command("at wm c1 33 f1 3e", true);
+    } else {
+        s_min_gap = 0;
+    }
+}
+
 void
 ELM327_connect(void)
 {
     static const char id_string[] = {'E', 'L', 'M', '3', '2'};
 
     UART_init(UART, UART_TX | UART_RX, BAUD);
+    UART_set_rx_trigger(UART, '>');
 
     pin_set_direction(RTS_PIN, PIN_OUTPUT);
     pin_set_direction(POWER_CTRL_PIN, PIN_INPUT);
@@ -418,6 +694,13 @@ ELM327_init(void)
 
     send_command("at ws", true);
 
+    /*
+     * Seed the backoff jitter from the timer tick the reset response arrived
+     * on. How long the ELM takes to reset varies, so units that start
+     * together (e.g. when the ignition is turned on) don't back off in step
+     */
+    srand((timer_get() << 8) | TCNT0);
+
     reset_state();
 
     /*
@@ -430,7 +713,13 @@ ELM327_init(void)
 bool
 ELM327_connected(void)
 {
-    return s_cannot_connect ? false : true;
+    return s_link_state == ELM327_LINK_UP;
+}
+
+ELM327_link_state_type
+ELM327_get_link_state(void)
+{
+    return s_link_state;
 }
 
 bool
@@ -469,8 +758,14 @@ ELM327_process(bool block)
                                 data_bytes, header[1]);
                         if (my_data_clbk)
                             my_data_clbk(header[1], data_buf, data_bytes);
-                        s_searching = false;
-                        s_cannot_connect = false;
+                        link_up();
+
+                        /*
+                         * The first response tells us that the ELM has
+                         * settled on a protocol
+                         */
+                        if (s_cur_proto == ELM327_PROTO_AUTO)
+                            s_link_cfg_pending = true;
                     } else {
                         printf("Error got data for unrequested PID 0x%02X"
                                 ENDL, header[1]);
@@ -478,8 +773,7 @@ ELM327_process(bool block)
                 } else if (strcmp(buf, "NO DATA") == 0) {
                     if (my_no_data_clbk)
                         my_no_data_clbk( last_pid );
-                    s_searching = false;
-                    s_cannot_connect = false;
+                    link_up();
                 } else if (strcmp(buf, "SEARCHING...") == 0) {
                     printf("Searching" ENDL);
                     s_searching = true;
@@ -489,15 +783,33 @@ ELM327_process(bool block)
                     /* Nothing to do */
                 } else if (strcmp(buf, "LV RESET") == 0) {
                     //LED_strobe( 500 );
-                } else if (strcmp(buf, "UNABLE TO CONNECT") == 0) {
-                    s_cannot_connect = true;
+                } else if (is_link_error(buf)) {
+                    printf("Link error '%s'" ENDL, buf);
+                    link_down();
+                } else if (strncmp(buf, "BUS INIT", 8) == 0) {
+                    /*
+                     * The K-line session was (re)initialized. If it failed,
+                     * treat it the same as being unable to connect.
+                     * Otherwise, the protocol may have changed, so the link
+                     * needs to be configured again
+                     */
+                    if (strstr(buf, "ERROR") != NULL) {
+                        link_down();
+                    } else {
+                        s_searching = true;
+                        s_link_cfg_pending = true;
+                    }
                 } else {
                     printf("Unknown Line Buffer '%s'" ENDL, buf);
                 }
             }
         }
         //timer_process();
-    } while (block && !s_elm_ready);
+    } while (block ? !s_elm_ready :
+            (buf != NULL && s_cmplt_pid == OBD_PID_CNT));
+
+    if (s_elm_ready && s_link_cfg_pending)
+        configure_link();
 }
 
 void
@@ -672,14 +984,81 @@ get_pid_helper(obd_pid_t8 pid, void (*rqst)(obd_pid_t8), uint8_t
     return my_get_pid_data.found;
 }
 
+/*
+ * Formats a request for the current data of one or more PIDs
+ */
+static void
+format_crnt_pids(char *buffer, size_t size, obd_pid_t8 const *pids,
+        uint8_t cnt)
+{
+    uint8_t i;
+    uint8_t len;
+
+    len = snprintf(buffer, size, "%02u", OBD_SHOW_DATA);
+
+    for (i = 0; i < cnt && len < size; i++)
+        len += snprintf(&buffer[len], size - len, "%02x", pids[i]);
+}
+
 void
 ELM327_rqst_crnt_pid(obd_pid_t8 pid)
 {
-    char buffer[10];
+    ELM327_rqst_crnt_pids(&pid, 1);
+}
 
-    snprintf(buffer, sizeof(buffer), "%02u%02x", OBD_SHOW_DATA, pid);
-    last_pid = pid;
+/*
+ * Requests the current data of several PIDs at once. Only supported on CAN
+ * (see ELM327_multi_pid()). The response is reported as the first PID, with
+ * the data of each PID followed by the next PID and its data
+ */
+void
+ELM327_rqst_crnt_pids(obd_pid_t8 const *pids, uint8_t cnt)
+{
+    char buffer[STAGE_BUFFER_SZ];
+
+    cnt = minval(cnt, ELM327_MAX_PIDS);
+
+    format_crnt_pids(buffer, sizeof(buffer), pids, cnt);
     send_command(buffer, false);
+    last_pid = pids[0];
+    last_pid_cnt = cnt;
+    s_rqst_pending = true;
+    s_repeatable = true;
+}
+
+/*
+ * Returns true if the last command sent to the ELM was a request for only this
+ * PID, so it can be repeated. A multi-PID request is reported as its first
+ * PID, but repeating it would also request the rest of its PIDs
+ */
+bool
+ELM327_can_repeat(obd_pid_t8 pid)
+{
+    return s_repeatable && last_pid == pid && last_pid_cnt == 1;
+}
+
+/*
+ * Repeats the last request. The ELM repeats its last command when it receives
+ * an empty one, which saves formatting and sending the command again. Only
+ * valid if ELM327_can_repeat() is true, since the last command may have been
+ * an AT command
+ */
+void
+ELM327_rqst_repeat(void)
+{
+    send_command("", false);
+    s_rqst_pending = true;
+    s_repeatable = true;
+}
+
+/*
+ * Returns true if several PIDs can be requested at once on the current
+ * protocol
+ */
+bool
+ELM327_multi_pid(void)
+{
+    return proto_is_ISO_15765(s_cur_proto);
 }
 
 bool
@@ -695,8 +1074,10 @@ ELM327_rqst_freeze_pid(obd_pid_t8 pid)
     char buffer[10];
 
     snprintf(buffer, sizeof(buffer), "%02u%02x", OBD_FREEZE_DATA, pid);
-    last_pid = pid;
     send_command(buffer, false);
+    last_pid = pid;
+    last_pid_cnt = 1;
+    s_rqst_pending = true;
 }
 
 bool
@@ -714,15 +1095,116 @@ ELM327_set_clbk(ELM327_data_clbk data_clbk,
     my_no_data_clbk = no_data_clbk;
 }
 
+/*
+ * Returns true if a request can be staged with ELM327_stage_crnt_pid(). This
+ * is only possible while a PID request is in progress on a protocol that
+ * doesn't require pacing. Nothing is staged until the protocol is known and
+ * the link has been configured for it, so the ELM is left to prompt for the
+ * link configuration
+ */
+bool
+ELM327_can_stage(void)
+{
+    return !s_staged && s_rqst_pending && !s_elm_ready && !my_echo_enabled &&
+        s_min_gap == 0 && s_link_state == ELM327_LINK_UP &&
+        !s_link_cfg_pending && s_cur_proto != ELM327_PROTO_AUTO;
+}
+
+/*
+ * Stages a request for a current PID to be sent the instant the ELM prompts
+ * for the next command, without waiting for ELM327_process() to be called
+ */
+bool
+ELM327_stage_crnt_pid(obd_pid_t8 pid)
+{
+    return ELM327_stage_crnt_pids(&pid, 1);
+}
+
+bool
+ELM327_stage_crnt_pids(obd_pid_t8 const *pids, uint8_t cnt)
+{
+    if (!ELM327_can_stage())
+        return false;
+
+    cnt = minval(cnt, ELM327_MAX_PIDS);
+
+    format_crnt_pids(s_staged_cmd, sizeof(s_staged_cmd) - strlen(endl), pids,
+            cnt);
+    strcat(s_staged_cmd, endl);
+
+    if (!UART_tx_on_trigger(UART, s_staged_cmd, strlen(s_staged_cmd)))
+        return false;
+
+    s_staged_pid = pids[0];
+    s_staged_cnt = cnt;
+    s_staged = true;
+    return true;
+}
+
+/*
+ * Stages a repeat of the request that is in progress
+ */
+bool
+ELM327_stage_repeat(void)
+{
+    if (!ELM327_can_stage())
+        return false;
+
+    strcpy(s_staged_cmd, endl);
+
+    if (!UART_tx_on_trigger(UART, s_staged_cmd, strlen(s_staged_cmd)))
+        return false;
+
+    s_staged_pid = last_pid;
+    s_staged_cnt = last_pid_cnt;
+    s_staged = true;
+    return true;
+}
+
+/*
+ * Returns the time the command in progress was sent to the ELM, in
+ * milliseconds
+ */
+uint32_t
+ELM327_get_rqst_time(void)
+{
+    return s_rqst_time;
+}
+
+/*
+ * Returns the PID of the most recently completed request, or OBD_PID_CNT if
+ * no request has completed since the last call
+ */
+obd_pid_t8
+ELM327_get_cmplt_pid(void)
+{
+    obd_pid_t8 pid = s_cmplt_pid;
+
+    s_cmplt_pid = OBD_PID_CNT;
+    return pid;
+}
+
+/*
+ * Returns the number of milliseconds the ELM spent idle at the prompt during
+ * the last measurement second
+ */
+uint16_t
+ELM327_get_idle_time(void)
+{
+    return s_idle_time;
+}
+
 bool
 ELM327_is_ready(void)
 {
-    return s_elm_ready;
+    return s_elm_ready && paced() && link_ready();
 }
 
 void
 ELM327_low_power_mode(void)
 {
+    unstage();
+
     my_data_clbk = NULL;
     my_no_data_clbk = NULL;
 
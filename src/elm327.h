@@ -26,6 +26,13 @@
 
 #include "obd_pid.h"
 
+/*
+ * Maximum number of PIDs in one request. A CAN vehicle can answer up to 6,
+ * but two PIDs of up to two bytes each is as many as are guaranteed to fit in
+ * a single frame response
+ */
+#define ELM327_MAX_PIDS (2)
+
 typedef void (*ELM327_data_clbk)(obd_pid_t8 pid, uint8_t const *data,
         uint8_t len);
 typedef void (*ELM327_no_data_clbk)(obd_pid_t8 pid);
@@ -50,9 +57,18 @@ typedef uint8_t ELM327_proto_type; enum {
     /* C */ ELM327_PROTO_USER2_CAN
 };
 
+typedef uint8_t ELM327_link_state_type; enum {
+    ELM327_LINK_UP,         /* Vehicle is responding */
+    ELM327_LINK_RETRY,      /* Retrying the connection after a failure */
+    ELM327_LINK_BACKOFF     /* Waiting before the next connection attempt */
+};
+
 bool
 ELM327_connected(void);
 
+ELM327_link_state_type
+ELM327_get_link_state(void);
+
 bool
 ELM327_searching(void);
 
@@ -92,6 +108,18 @@ ELM327_get_voltage(void);
 void
 ELM327_rqst_crnt_pid(obd_pid_t8 pid);
 
+void
+ELM327_rqst_crnt_pids(obd_pid_t8 const *pids, uint8_t cnt);
+
+bool
+ELM327_multi_pid(void);
+
+bool
+ELM327_can_repeat(obd_pid_t8 pid);
+
+void
+ELM327_rqst_repeat(void);
+
 bool
 ELM327_get_crnt_pid(obd_pid_t8 pid, uint8_t buffer[OBD_PID_MAX_LEN],
         size_t *len);
@@ -106,6 +134,27 @@ ELM327_get_freeze_pid(obd_pid_t8 pid, uint8_t buffer[OBD_PID_MAX_LEN],
 void
 ELM327_set_clbk(ELM327_data_clbk data_clbk, ELM327_no_data_clbk no_data_clbk);
 
+bool
+ELM327_can_stage(void);
+
+bool
+ELM327_stage_crnt_pid(obd_pid_t8 pid);
+
+bool
+ELM327_stage_crnt_pids(obd_pid_t8 const *pids, uint8_t cnt);
+
+bool
+ELM327_stage_repeat(void);
+
+uint32_t
+ELM327_get_rqst_time(void);
+
+obd_pid_t8
+ELM327_get_cmplt_pid(void);
+
+uint16_t
+ELM327_get_idle_time(void);
+
 bool
 ELM327_is_ready(void);
 
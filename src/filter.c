@@ -0,0 +1,152 @@
+/*
+ * Copyright 2017 Joshua Watt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include "filter.h"
+#include "utl.h"
+
+/*
+ * Filters for smoothing data values. All the filters take the time of each
+ * sample into account, so the amount of smoothing depends on the time
+ * constant (tau, in ms) and not on how often the value is polled.
+ *
+ * FILTER_EMA:          Exponential moving average
+ * FILTER_MEDIAN:       Median of the last 3 samples. Rejects single sample
+ *                      spikes without any lag on steady changes
+ * FILTER_ALPHA_BETA:   Tracks the value and its rate of change, so it
+ *                      follows ramps (e.g. acceleration) without the lag of
+ *                      an EMA
+ *
+ * The EMA and alpha-beta filters keep the value (x) in Q8. The alpha-beta
+ * filter keeps the rate (v) in Q16 per ms. The median filter keeps the
+ * previous two raw samples in x and v
+ */
+
+/*
+ * Longest sample gap that is used. A longer gap (e.g. the first sample after
+ * the link comes back) is treated as this long
+ */
+#define FILTER_MAX_DT (1000)
+
+#define Q8_SHIFT (8)
+#define TO_Q8(_v) ((_v) * (1l << Q8_SHIFT))
+
+void
+FILTER_reset(struct filter_state *f)
+{
+    f->init = false;
+}
+
+static int32_t
+median3(int32_t a, int32_t b, int32_t c)
+{
+    if (a > b) {
+        if (b > c)
+            return b;
+        return minval(a, c);
+    }
+
+    if (a > c)
+        return a;
+    return minval(b, c);
+}
+
+/*
+ * Smoothing factor for a sample dt after the last in Q8. This is
+ * dt / (tau + dt), the first order approximation of 1 - e^(-dt / tau). With
+ * no time constant the sample is taken as is
+ */
+static int32_t
+smoothing(uint16_t dt, uint16_t tau)
+{
+    if (tau == 0)
+        return (int32_t)1 << Q8_SHIFT;
+
+    return ((uint32_t)dt << Q8_SHIFT) / ((uint32_t)tau + dt);
+}
+
+int32_t
+FILTER_apply(filter_t8 type, uint16_t tau, struct filter_state *f,
+        int32_t input, uint32_t time)
+{
+    uint16_t dt;
+    int32_t alpha;
+    int32_t beta;
+    int32_t r;
+    int32_t out;
+
+    if (type == FILTER_NONE)
+        return input;
+
+    if (!f->init) {
+        f->init = true;
+        f->time = time;
+
+        if (type == FILTER_MEDIAN) {
+            f->x = input;
+            f->v = input;
+        } else {
+            f->x = TO_Q8(input);
+            f->v = 0;
+        }
+
+        return input;
+    }
+
+    dt = minval((uint16_t)((uint16_t)time - f->time), FILTER_MAX_DT);
+    f->time = time;
+
+    switch (type) {
+    case FILTER_EMA:
+        alpha = smoothing(dt, tau);
+        f->x += (TO_Q8(input) - f->x) * alpha >> Q8_SHIFT;
+        break;
+
+    case FILTER_MEDIAN:
+        out = median3(input, f->x, f->v);
+        f->v = f->x;
+        f->x = input;
+        return out;
+
+    case FILTER_ALPHA_BETA:
+        /*
+         * Predict where the value should be now, then correct the value and
+         * rate by the residual. beta = alpha^2 / (2 - alpha) gives a
+         * critically damped response
+         */
+        alpha = smoothing(dt, tau);
+
+        if (dt == 0)
+            dt = 1;
+
+        beta = (alpha * alpha) / ((2 << Q8_SHIFT) - alpha);
+
+        f->x += (f->v * dt) >> Q8_SHIFT;
+        r = TO_Q8(input) - f->x;
+        f->x += (r * alpha) >> Q8_SHIFT;
+        f->v += (r * beta) / dt;
+        break;
+
+    default:
+        return input;
+    }
+
+    return (f->x + (1 << (Q8_SHIFT - 1))) >> Q8_SHIFT;
+}
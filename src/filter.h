@@ -0,0 +1,55 @@
+/*
+ * Copyright 2017 Joshua Watt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint8_t filter_t8; enum {
+    FILTER_NONE,
+    FILTER_EMA,
+    FILTER_MEDIAN,
+    FILTER_ALPHA_BETA,
+
+    FILTER_CNT
+};
+
+/*
+ * State of one filter, 11 bytes. x and v are the estimate and its rate for the
+ * EMA and alpha-beta filters, or the previous two samples for the median
+ */
+struct filter_state {
+    int32_t x;
+    int32_t v;
+    uint16_t time;
+    bool init;
+};
+
+void
+FILTER_reset(struct filter_state *f);
+
+int32_t
+FILTER_apply(filter_t8 type, uint16_t tau, struct filter_state *f,
+        int32_t input, uint32_t time);
+
+#endif /* _FILTER_H_ */
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2017 Joshua Watt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <stdbool.h>
+
+#include "fmt.h"
+#include "utl.h"
+
+/*
+ * Enough room for every digit of an int32_t, the decimal point and a sign
+ */
+#define FMT_MAX_DIGITS (13)
+
+/*
+ * Formats a fixed point value into buf, which is len bytes long. The value
+ * has precision implied decimal places (e.g. 253 with a precision of 1 is
+ * "25.3"). If the result is less than width characters it is padded with
+ * spaces, on the left if FMT_RIGHT is set. The output is truncated to fit in
+ * buf, which is always NUL terminated. Returns the number of characters
+ * written, not counting the NUL
+ */
+uint8_t
+FMT_fixed(char *buf, uint8_t len, int32_t v, uint8_t precision,
+        uint8_t width, uint8_t flags)
+{
+    char digits[FMT_MAX_DIGITS];
+    uint8_t n;
+    uint8_t i;
+    uint8_t pad;
+    uint32_t u;
+    bool neg;
+
+    if (len == 0)
+        return 0;
+
+    /*
+     * Leave room in digits for the leading zero, the decimal point and the
+     * sign
+     */
+    precision = minval(precision, FMT_MAX_DIGITS - 3);
+
+    neg = (v < 0);
+    u = neg ? -(uint32_t)v : (uint32_t)v;
+
+    /*
+     * Generate the digits in reverse order
+     */
+    n = 0;
+    do {
+        if (n == precision && n != 0)
+            digits[n++] = '.';
+
+        digits[n++] = '0' + (u % 10);
+        u /= 10;
+    } while (u != 0 || n <= precision);
+
+    if (neg)
+        digits[n++] = '-';
+    else if (flags & FMT_PLUS)
+        digits[n++] = '+';
+
+    pad = (width > n) ? width - n : 0;
+
+    i = 0;
+
+    if (flags & FMT_RIGHT) {
+        for (; pad && i < len - 1; pad--)
+            buf[i++] = ' ';
+    }
+
+    while (n && i < len - 1)
+        buf[i++] = digits[--n];
+
+    for (; pad && i < len - 1; pad--)
+        buf[i++] = ' ';
+
+    buf[i] = '\0';
+
+    return i;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2017 Joshua Watt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _FMT_H_
+#define _FMT_H_
+
+#include <stdint.h>
+
+/*
+ * Formatting flags
+ */
+#define FMT_PLUS    (0x01)  /* Always show a sign, even for positive values */
+#define FMT_RIGHT   (0x02)  /* Right align the value, padding with spaces */
+
+uint8_t
+FMT_fixed(char *buf, uint8_t len, int32_t v, uint8_t precision,
+        uint8_t width, uint8_t flags);
+
+#endif /* _FMT_H_ */
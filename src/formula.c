@@ -0,0 +1,304 @@
+/*
+ * Copyright 2017 Joshua Watt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <avr/eeprom.h>
+
+#include "filter.h"
+#include "formula.h"
+#include "obd_data.h"
+#include "timer.h"
+#include "utl.h"
+
+/*
+ * User defined data items are small stack based programs stored in EEPROM.
+ * They are provisioned with the EEPROM image (formula_ee_mem below), so new
+ * values can be added by reprogramming the EEPROM without changing the
+ * firmware. For example, boost in kPa is:
+ *
+ *      PUSH_PID 0x0B, PUSH_PID 0x33, SUB, END
+ *
+ * Formulas are validated when they are loaded: every opcode and operand must
+ * be in bounds, PIDs must be ones that can be decoded, the precision must be
+ * at most FORMULA_MAX_PREC, the stack can never underflow or exceed
+ * FORMULA_STACK_SZ, and the formula must leave exactly one value. Because there are no jumps an
+ * evaluation is at most FORMULA_MAX_LEN steps, and the only error left at
+ * run time is division by zero.
+ *
+ * Each formula may use at most one EMA, which has its own filter state
+ */
+#define FORMULA_STACK_SZ (6)
+
+struct formula_ee_type {
+    uint8_t prec;
+    uint8_t code[FORMULA_MAX_LEN];
+};
+
+/*
+ * EEPROM Varaibles
+ */
+static struct formula_ee_type EEMEM formula_ee_mem[FORMULA_CNT] = {
+    {   0,  {   FORMULA_PUSH_PID, OBD_PID_INTAKE_ABS_PRES,
+                FORMULA_PUSH_PID, OBD_PID_BARO_PRES,
+                FORMULA_SUB,
+                FORMULA_END     }   },
+    {   0,  {   FORMULA_END     }   },
+    {   0,  {   FORMULA_END     }   },
+    {   0,  {   FORMULA_END     }   },
+};
+
+static struct {
+    bool valid;
+    uint8_t pid_cnt;
+    obd_pid_t8 pids[FORMULA_MAX_PIDS];
+    struct filter_state ema;
+} formulas[FORMULA_CNT];
+
+/*
+ * Number of operand bytes that follow each opcode
+ */
+static const uint8_t op_operands[FORMULA_OP_CNT] = {
+    [FORMULA_PUSH_PID] = 1,
+    [FORMULA_PUSH_CONST] = 2,
+    [FORMULA_SHR] = 1,
+    [FORMULA_EMA] = 2,
+};
+
+/*
+ * Change in stack depth caused by each opcode
+ */
+static const int8_t op_depth[FORMULA_OP_CNT] = {
+    [FORMULA_PUSH_PID] = 1,
+    [FORMULA_PUSH_CONST] = 1,
+    [FORMULA_ADD] = -1,
+    [FORMULA_SUB] = -1,
+    [FORMULA_MUL] = -1,
+    [FORMULA_DIV] = -1,
+    [FORMULA_MIN] = -1,
+    [FORMULA_MAX] = -1,
+};
+
+static uint8_t
+read_code(uint8_t f, uint8_t pc)
+{
+    return eeprom_read_byte(&formula_ee_mem[f].code[pc]);
+}
+
+static int16_t
+read_code16(uint8_t f, uint8_t pc)
+{
+    return read_code(f, pc) | ((uint16_t)read_code(f, pc + 1) << 8);
+}
+
+/*
+ * Checks that a formula is well formed, and collects the PIDs it uses
+ */
+static bool
+load(uint8_t f)
+{
+    uint8_t pc;
+    uint8_t i;
+    uint8_t ema_cnt;
+    int8_t depth;
+    formula_op_t8 op;
+    obd_pid_t8 pid;
+
+    formulas[f].valid = false;
+    formulas[f].pid_cnt = 0;
+    FILTER_reset(&formulas[f].ema);
+
+    if (eeprom_read_byte(&formula_ee_mem[f].prec) > FORMULA_MAX_PREC)
+        return false;
+
+    depth = 0;
+    ema_cnt = 0;
+    pc = 0;
+
+    while (true) {
+        op = read_code(f, pc);
+
+        if (op >= FORMULA_OP_CNT)
+            return false;
+
+        if (op == FORMULA_END)
+            break;
+
+        if (pc + 1 + op_operands[op] >= FORMULA_MAX_LEN)
+            return false;
+
+        /*
+         * Pushes need nothing on the stack, unary opcodes need one value and
+         * binary opcodes need two
+         */
+        if (depth < 1 - op_depth[op])
+            return false;
+
+        depth += op_depth[op];
+        if (depth > FORMULA_STACK_SZ)
+            return false;
+
+        if (op == FORMULA_EMA && ++ema_cnt > 1)
+            return false;
+
+        if (op == FORMULA_SHR && read_code(f, pc + 1) >= 32)
+            return false;
+
+        if (op == FORMULA_PUSH_PID) {
+            pid = read_code(f, pc + 1);
+
+            if (!OBD_can_decode(pid))
+                return false;
+
+            for (i = 0; i < formulas[f].pid_cnt &&
+                    formulas[f].pids[i] != pid; i++)
+                ;
+
+            if (i == formulas[f].pid_cnt) {
+                if (i == FORMULA_MAX_PIDS)
+                    return false;
+
+                formulas[f].pids[formulas[f].pid_cnt++] = pid;
+            }
+        }
+
+        pc += 1 + op_operands[op];
+    }
+
+    if (depth != 1)
+        return false;
+
+    formulas[f].valid = true;
+    return true;
+}
+
+void
+FORMULA_init(void)
+{
+    uint8_t f;
+
+    for (f = 0; f < FORMULA_CNT; f++)
+        load(f);
+}
+
+/*
+ * Returns the display precision of a formula (number of implied decimal
+ * places in the result)
+ */
+uint8_t
+FORMULA_get_prec(uint8_t f)
+{
+    return eeprom_read_byte(&formula_ee_mem[f].prec);
+}
+
+/*
+ * Returns the PIDs that a formula depends on
+ */
+uint8_t
+FORMULA_get_pids(uint8_t f, obd_pid_t8 const **pids)
+{
+    *pids = formulas[f].pids;
+    return formulas[f].pid_cnt;
+}
+
+/*
+ * Evaluates a formula. Returns false if it isn't valid or divides by zero
+ */
+bool
+FORMULA_eval(uint8_t f, int32_t *result)
+{
+    int32_t stack[FORMULA_STACK_SZ];
+    uint8_t sp;
+    uint8_t pc;
+    formula_op_t8 op;
+    int32_t a;
+    int32_t b;
+
+    if (!formulas[f].valid)
+        return false;
+
+    sp = 0;
+    pc = 0;
+
+    while ((op = read_code(f, pc)) != FORMULA_END) {
+        switch (op) {
+        case FORMULA_PUSH_PID:
+            stack[sp++] = OBD_get_value(read_code(f, pc + 1));
+            break;
+
+        case FORMULA_PUSH_CONST:
+            stack[sp++] = read_code16(f, pc + 1);
+            break;
+
+        case FORMULA_SHR:
+            stack[sp - 1] >>= read_code(f, pc + 1);
+            break;
+
+        case FORMULA_NEG:
+            stack[sp - 1] = -stack[sp - 1];
+            break;
+
+        case FORMULA_EMA:
+            stack[sp - 1] = FILTER_apply(FILTER_EMA,
+                    (uint16_t)read_code16(f, pc + 1), &formulas[f].ema,
+                    stack[sp - 1], timer_get());
+            break;
+
+        default:
+            b = stack[--sp];
+            a = stack[sp - 1];
+
+            switch (op) {
+            case FORMULA_ADD:
+                a += b;
+                break;
+
+            case FORMULA_SUB:
+                a -= b;
+                break;
+
+            case FORMULA_MUL:
+                a *= b;
+                break;
+
+            case FORMULA_DIV:
+                if (b == 0)
+                    return false;
+                a /= b;
+                break;
+
+            case FORMULA_MIN:
+                a = minval(a, b);
+                break;
+
+            case FORMULA_MAX:
+                a = maxval(a, b);
+                break;
+            }
+
+            stack[sp - 1] = a;
+            break;
+        }
+
+        pc += 1 + op_operands[op];
+    }
+
+    *result = stack[0];
+    return true;
+}
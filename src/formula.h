@@ -0,0 +1,83 @@
+/*
+ * Copyright 2017 Joshua Watt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _FORMULA_H_
+#define _FORMULA_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "obd_pid.h"
+
+/*
+ * Number of user defined formulas
+ */
+#define FORMULA_CNT (4)
+
+/*
+ * Maximum length of a formula in bytes, including the FORMULA_END
+ */
+#define FORMULA_MAX_LEN (24)
+
+/*
+ * Maximum number of different PIDs a formula can use
+ */
+#define FORMULA_MAX_PIDS (4)
+
+/*
+ * Maximum display precision of a formula. Any more decimal places wouldn't
+ * fit in a data item
+ */
+#define FORMULA_MAX_PREC (3)
+
+/*
+ * Formula opcodes. Operands follow the opcode in the bytecode
+ */
+typedef uint8_t formula_op_t8; enum {
+    FORMULA_END,        /* End of the formula. The result is the top of stack */
+    FORMULA_PUSH_PID,   /* 1 byte PID. Pushes the decoded value of the PID */
+    FORMULA_PUSH_CONST, /* 2 byte signed constant, little endian */
+    FORMULA_ADD,
+    FORMULA_SUB,        /* Pops b, then a and pushes a - b */
+    FORMULA_MUL,
+    FORMULA_DIV,        /* Pops b, then a and pushes a / b */
+    FORMULA_SHR,        /* 1 byte shift count */
+    FORMULA_NEG,
+    FORMULA_MIN,
+    FORMULA_MAX,
+    FORMULA_EMA,        /* 2 byte time constant in ms, little endian */
+
+    FORMULA_OP_CNT
+};
+
+void
+FORMULA_init(void);
+
+uint8_t
+FORMULA_get_prec(uint8_t f);
+
+uint8_t
+FORMULA_get_pids(uint8_t f, obd_pid_t8 const **pids);
+
+bool
+FORMULA_eval(uint8_t f, int32_t *result);
+
+#endif /* _FORMULA_H_ */
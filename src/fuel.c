@@ -0,0 +1,185 @@
+/*
+ * Copyright 2017 Joshua Watt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <avr/eeprom.h>
+#include <stdlib.h>
+
+#include "fuel.h"
+#include "utl.h"
+
+/*
+ * The fuel level sender is noisy (fuel sloshes around the tank), so the level
+ * is estimated with a least squares line fit of all the samples since the
+ * tank was last filled. The sums are kept incrementally, so each sample is
+ * O(1). Time is in minutes since the fit started.
+ *
+ * When the sample count or squared time sum gets too large every sum is
+ * halved. This keeps
+ * them in 32 bits, and weights the fit toward recent samples
+ */
+#define MS_PER_MIN (60ul * 1000ul)
+#define SUM_TT_MAX ((uint32_t)1 << 31)
+
+/*
+ * A refuel is detected when REFUEL_CNT samples in a row are more than
+ * REFUEL_DELTA percent above the fitted level
+ */
+#define REFUEL_DELTA (10)
+#define REFUEL_CNT (3)
+
+#define DEFAULT_TANK_SIZE (16)
+
+/*
+ * EEPROM Varaibles
+ */
+static uint8_t EEMEM tank_size_eemem = DEFAULT_TANK_SIZE;
+
+static struct {
+    uint32_t start;
+    uint16_t n;
+    uint32_t t;
+    uint32_t l;
+    uint32_t tt;
+    uint32_t tl;
+} fit;
+
+static uint8_t refuel_cnt;
+
+/*
+ * Starts a new fit
+ */
+static void
+reset_fit(uint32_t time)
+{
+    fit.start = time;
+    fit.n = 0;
+    fit.t = 0;
+    fit.l = 0;
+    fit.tt = 0;
+    fit.tl = 0;
+    refuel_cnt = 0;
+}
+
+/*
+ * Gets the fitted fuel level at a time, in 1/256 percent. Returns false if
+ * there are no samples
+ */
+bool
+FUEL_get_level(uint32_t time, uint16_t *level)
+{
+    int64_t num;
+    int64_t den;
+    int32_t slope;
+    int32_t v;
+    int32_t t;
+
+    if (fit.n == 0)
+        return false;
+
+    /*
+     * The level at the mean time is the mean level. Move along the fitted
+     * slope (in 1/65536 percent per minute) from there
+     */
+    v = ((int32_t)fit.l << 8) / fit.n;
+
+    num = (int64_t)fit.n * fit.tl - (int64_t)fit.t * fit.l;
+    den = (int64_t)fit.n * fit.tt - (int64_t)fit.t * fit.t;
+
+    if (den != 0) {
+        slope = (num << 16) / den;
+        t = (time - fit.start) / MS_PER_MIN;
+        v += (slope * ((int64_t)t * fit.n - fit.t) / fit.n) >> 8;
+    }
+
+    *level = minval(maxval(v, 0), 100l << 8);
+    return true;
+}
+
+void
+FUEL_add_level(uint8_t level, uint32_t time)
+{
+    uint16_t cur;
+    uint32_t t;
+
+    if (FUEL_get_level(time, &cur) && level > (cur >> 8) + REFUEL_DELTA) {
+        if (++refuel_cnt >= REFUEL_CNT)
+            reset_fit(time);
+        else
+            return;
+    } else {
+        refuel_cnt = 0;
+    }
+
+    if (fit.n == 0)
+        fit.start = time;
+
+    t = (time - fit.start) / MS_PER_MIN;
+
+    if (fit.n == UINT16_MAX || fit.tt + t * t >= SUM_TT_MAX) {
+        fit.n /= 2;
+        fit.t /= 2;
+        fit.l /= 2;
+        fit.tt /= 2;
+        fit.tl /= 2;
+    }
+
+    fit.n++;
+    fit.t += t;
+    fit.l += level;
+    fit.tt += t * t;
+    fit.tl += t * level;
+}
+
+/*
+ * Gets the fuel remaining in the tank at a time, in 0.01 gallons
+ */
+bool
+FUEL_get_remaining(uint32_t time, uint16_t *fuel)
+{
+    uint16_t level;
+
+    if (!FUEL_get_level(time, &level))
+        return false;
+
+    *fuel = ((uint32_t)level * FUEL_get_tank_size()) >> 8;
+    return true;
+}
+
+void
+FUEL_set_tank_size(uint8_t gal)
+{
+    eeprom_update_byte(&tank_size_eemem, gal);
+}
+
+/*
+ * Returns the size of the tank in gallons
+ */
+uint8_t
+FUEL_get_tank_size(void)
+{
+    return eeprom_read_byte(&tank_size_eemem);
+}
+
+void
+FUEL_init(void)
+{
+    reset_fit(0);
+}
@@ -20,255 +20,739 @@
  * IN THE SOFTWARE.
  */
 #include <avr/eeprom.h>
-#include <math.h>
-#include <stdio.h>
+#include <avr/io.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "elm327.h"
+#include "filter.h"
+#include "fmt.h"
+#include "formula.h"
+#include "fuel.h"
 #include "hud_data.h"
 #include "obd_data.h"
+#include "perf.h"
+#include "rolling.h"
+#include "shift.h"
 #include "timer.h"
+#include "trip.h"
 #include "utl.h"
 
 #define _s(_a) _a, cnt_of_array( _a )
 
-#define SPD_FILTER_CONSTANT (0.5)
-#define INST_FUEL_CONSTANT (0.5)
-#define MAX_AVG_SAMPLES (10000)
+/*
+ * Maximum number of watched data items that can be filtered at once
+ */
+#define MAX_FILTERS (8)
+#define NO_FILTER (0xFF)
+
+/*
+ * Fast changing data items are extrapolated between samples from the last two
+ * samples. Predictions are published every EXTRAP_INTVL milliseconds, and
+ * never run further ahead than the time between the two samples, or
+ * EXTRAP_MAX_TIME if that is shorter
+ */
+#define MAX_EXTRAPS (4)
+#define NO_EXTRAP (0xFF)
+#define EXTRAP_INTVL (50)
+#define EXTRAP_MAX_TIME (1000)
+
+/*
+ * Data item definition flags
+ */
+#define DEF_EXTRAP (0x01)   /* Extrapolate between samples */
+#define DEF_GROUP  (0x02)   /* PIDs must be sampled together */
 
-/* Save the average fuel economy every 10 minutes */
-#define AVG_ECON_WRITE_INTVL (10l * 60l * 1000l)
+/*
+ * Maximum number of data items that can have statistics tracked at once, and
+ * how long a peak is held before it starts to decay toward the current value
+ */
+#define MAX_STATS (4)
+#define NO_STATS (0xFF)
+#define PEAK_HOLD_TIME (3000)
 
-#define KPH_TO_MPH (0.641371192f)
-#define KPA_TO_MMHG (7.50061683f)
-#define KPA_TO_PSI (0.145038f)
+/*
+ * Maximum number of different PIDs that can be polled at once. This is more
+ * than enough for a full page of data items plus the always on items
+ */
+#define MAX_SCHED_PIDS (12)
 
-#define AVG_ECON_VALID_SIG (0xAA)
+/*
+ * Dependency bit for a PID that didn't fit in the schedule. It is never valid
+ */
+#define SCHED_UNAVAIL ((uint16_t)1 << 15)
 
 /*
- * EEPROM Varaibles
+ * Each level of priority lets a PID be picked up to this many milliseconds
+ * ahead of a lower priority PID with an earlier deadline
+ */
+#define PRIO_SLACK (50)
+
+/*
+ * A PID's value is stale once it is older than 2^STALE_SHIFT times the
+ * longest interval it should be polled at. Data items that depend on a stale
+ * PID are shown as stale
+ */
+#define STALE_SHIFT (1)
+
+STATIC_ASSERT(MAX_SCHED_PIDS < 15);
+STATIC_ASSERT(MAX_FILTERS <= 8);
+STATIC_ASSERT(MAX_STATS <= 8);
+STATIC_ASSERT(MAX_EXTRAPS <= 8);
+STATIC_ASSERT(HUD_DATA_CNT <= HUD_DATA_ITEM_MASK + 1);
+STATIC_ASSERT(HUD_DATA_CNT <= 64);
+STATIC_ASSERT(HUD_VAR_CNT <= (1 << (8 - HUD_DATA_VAR_SHIFT)));
+
+/*
+ * The poll interval of each PID adapts to how often a new value changes what
+ * is displayed. The change frequency is tracked as an exponential moving
+ * average (in 1/255ths, with a weight of 1/2^CHG_RATE_SHIFT per sample). If
+ * more than CHG_RATE_HI of samples change the display the interval is
+ * shortened by 1/4; if fewer than CHG_RATE_LO do it is lengthened by 1/4.
+ * The rate of change of the raw value is averaged with the same weight, and a
+ * sample that moves more than twice as fast as the average also shortens the
+ * interval, so a signal that starts moving is caught before its display lags
+ */
+#define CHG_RATE_SHIFT (3)
+#define CHG_RATE_HI (128)
+#define CHG_RATE_LO (32)
+
+/*
+ * Items that aren't visible (e.g. average fuel economy when it is always on)
+ * are refreshed 2^HIDDEN_INTVL_SHIFT times less often than their target
+ */
+#define HIDDEN_INTVL_SHIFT (2)
+
+/*
+ * PIDs that are integrated over time are polled at least this often however
+ * their items are shown, so no time between their samples is dropped as a
+ * gap. This leaves room for the poll to run late
+ */
+#define INTEGRATED_INTVL_MAX (TRIP_MAX_SAMPLE_GAP / 2)
+
+/*
+ * Number of samples kept while bursting
+ */
+#define BURST_RING_CNT (32)
+
+/*
+ * Unit conversions as Q16 fixed point multipliers
+ */
+#define Q16_SHIFT (16)
+#define KPH_TO_MPH_Q16 (42033ul)    /* 0.641371192 */
+#define KPA_TO_MMHG_Q16 (491560ul)  /* 7.50061683 */
+#define KPA_TO_PSI_Q16 (9505ul)     /* 0.145038 */
+
+/*
+ * 14.7 grams of air to 1 gram of gasoline - ideal air/fuel ratio
+ * 6.073 pounds per gallon - density of gasoline
+ * 453.59 grams per pound - conversion
+ * 0.621371 miles per hour/kilometers per hour - conversion
+ * 3600 seconds per hour - conversion
+ *
+ * Scaled so that (ECON_K * kph) / (MAF in 0.01 g/s) is MPG in 0.01 MPG
+ */
+#define ECON_K (72142ul)
+
+/*
+ * Scaled so that (TRIP_ECON_K * meters) / (mg of fuel) is MPG in 0.1 MPG, using
+ * the same speed conversion and gasoline density as above
  */
-EEMEM struct avg_econ_ee_type {
-    uint8_t sig;
-    uint16_t avg_samples;
-    float avg_econ_rate;
-    float avg_econ_spd;
-} avg_econ_ee_mem[2] =
-    {
-    {   AVG_ECON_VALID_SIG,   0,  0.0f,   0.0f    },
-    {   AVG_ECON_VALID_SIG,   0,  0.0f,   0.0f    }
-    };
+#define TRIP_ECON_K (17668ul)
+
+/* mg of gasoline in 0.01 gallons */
+#define MG_PER_CGAL (27547ul)
 
+/* Largest fuel economy that can be displayed, in 0.1 MPG */
+#define ECON_MAX (9999)
+
+/*
+ * EEPROM Varaibles
+ */
 static uint8_t EEMEM fuel_econ_always_on = true;
+static uint8_t EEMEM auto_dispatch_eemem = true;
 
+/*
+ * Each data item declares the range of intervals (in milliseconds) at which it
+ * would like its PIDs refreshed, and a priority that lets its PIDs be requested
+ * ahead of lower priority PIDs that are due at about the same time.
+ *
+ * Calculated values are passed through the item's filter (with a time
+ * constant in milliseconds) and then displayed with prec decimal places,
+ * rounded to a multiple of step. To stop the last digit flickering, the
+ * display only reverses the direction it last moved in when the value moves
+ * more than hyst away from what is shown. Both are in units of the last
+ * displayed digit, and 0 disables them.
+ *
+ * Items with DEF_EXTRAP in flags are extrapolated between samples. Items with
+ * DEF_GROUP are derived from several PIDs that must be sampled at the same
+ * time. Their PIDs are requested together, and they are calculated once all
+ * of them have arrived
+ */
 struct data_def_type {
     obd_pid_t8 const *pids;
     uint8_t cnt;
+    uint16_t intvl_min;
+    uint16_t intvl_max;
+    uint8_t prio;
+    uint8_t prec;
+    uint8_t step;
+    uint8_t hyst;
+    filter_t8 filter;
+    uint16_t tau;
+    uint8_t flags;
     void (*calc_func)(hud_data_t8 idx);
     char const *name;
 };
 
+struct sched_type {
+    obd_pid_t8 pid;
+    uint8_t prio;
+    uint8_t chg_rate;
+    uint16_t intvl;
+    uint16_t intvl_min;
+    uint16_t intvl_max;
+    uint32_t deadline;
+    uint32_t stale_time;
+    uint8_t heap_pos;
+    uint16_t group;
+    uint64_t items;
+    int32_t last_value;
+    uint16_t last_time;
+    uint16_t rate;
+};
+
 static struct {
     uint8_t watched;
+    uint8_t visible;
     bool valid;
     bool updated;
+    int8_t dir;
+    int32_t shown;
+    bool predicted;
+    uint8_t filt;
+    uint8_t extrap;
+    uint8_t stats;
+    uint8_t stats_refs;
+    uint16_t deps;
     char value[HUD_DATA_LEN];
 } hud_data[HUD_DATA_CNT];
 
-static uint8_t pid_ref_cnt[OBD_PID_CNT];
+static const struct data_def_type data_def[HUD_DATA_CNT];
+
+static struct filter_state filters[MAX_FILTERS];
+static uint8_t filters_used;
+
+/*
+ * The last two samples of an extrapolated data item, and the times they were
+ * taken. cnt is the number of samples held
+ */
+static struct {
+    uint8_t cnt;
+    uint32_t time[2];
+    int32_t value[2];
+} extraps[MAX_EXTRAPS];
+static uint8_t extraps_used;
+static uint32_t extrap_time;
+
+/*
+ * Running statistics of a data item, in the same units as its displayed
+ * value. updated has a bit for each variant that has changed since it was
+ * last read
+ */
+static struct {
+    bool valid;
+    uint8_t prec;
+    uint8_t updated;
+    uint16_t peak_time;
+    int32_t min;
+    int32_t max;
+    int32_t peak;
+} stats[MAX_STATS];
+static uint8_t stats_used;
+
+static char const *const var_names[HUD_VAR_CNT] = {
+    [HUD_VAR_CUR]   = "Now",
+    [HUD_VAR_MIN]   = "Min",
+    [HUD_VAR_MAX]   = "Max",
+    [HUD_VAR_PEAK]  = "Peak",
+};
+
+static struct sched_type sched[MAX_SCHED_PIDS];
+static uint8_t sched_cnt;
+
+/*
+ * Min-heap of schedule slots ordered by the time their value goes stale, so
+ * the stalest PID is always at the top
+ */
+static uint8_t stale_heap[MAX_SCHED_PIDS];
+
+/*
+ * Schedule slots of a group that still have to be requested one at a time,
+ * and slots that have received a value since their group was last requested
+ */
+static uint16_t group_pending;
+static uint16_t group_fresh;
+static uint16_t sched_valid;
+static uint16_t sched_changed;
+static uint64_t no_pid_items;
 static obd_pid_t8 last_pid;
-static uint16_t avg_samples;
-static float avg_econ_spd;
-static float avg_econ_rate;
+static bool my_auto_dispatch;
+
+/*
+ * State of a burst. pid is OBD_PID_CNT when no burst is running. The ring
+ * holds the most recent samples, timed in milliseconds from the start of the
+ * burst (wrapping every 65.5 seconds)
+ */
+static struct {
+    obd_pid_t8 pid;
+    uint32_t start;
+    uint32_t last;
+    uint16_t cnt;
+    uint8_t head;
+    int32_t max;
+    int64_t sum;
+    struct {
+        uint16_t time;
+        int32_t value;
+    } ring[BURST_RING_CNT];
+} burst;
+
+/*
+ * Updates the statistics of a data item with a new value
+ */
+static void
+update_stats(uint8_t s, int32_t v, uint8_t prec)
+{
+    uint16_t now = timer_get();
+    uint8_t updated = 0;
+
+    stats[s].prec = prec;
+
+    if (!stats[s].valid) {
+        stats[s].valid = true;
+        stats[s].min = v;
+        stats[s].max = v;
+        stats[s].peak = v;
+        stats[s].peak_time = now;
+        stats[s].updated = _BV(HUD_VAR_MIN) | _BV(HUD_VAR_MAX) |
+            _BV(HUD_VAR_PEAK);
+        return;
+    }
+
+    if (v < stats[s].min) {
+        stats[s].min = v;
+        updated |= _BV(HUD_VAR_MIN);
+    }
+
+    if (v > stats[s].max) {
+        stats[s].max = v;
+        updated |= _BV(HUD_VAR_MAX);
+    }
+
+    if (v >= stats[s].peak) {
+        stats[s].peak = v;
+        stats[s].peak_time = now;
+        updated |= _BV(HUD_VAR_PEAK);
+    } else if ((uint16_t)(now - stats[s].peak_time) > PEAK_HOLD_TIME) {
+        /*
+         * Decay 1/4 of the way toward the current value each sample
+         */
+        stats[s].peak = v + (stats[s].peak - v) * 3 / 4;
+        updated |= _BV(HUD_VAR_PEAK);
+    }
+
+    stats[s].updated |= updated;
+}
+
+/*
+ * Rounds a value to a multiple of the item's step
+ */
+static int32_t
+quantize(hud_data_t8 d, int32_t v)
+{
+    uint8_t step = data_def[d].step;
+
+    if (step > 1) {
+        if (v >= 0)
+            v = (v + step / 2) / step * step;
+        else
+            v = (v - step / 2) / step * step;
+    }
+
+    return v;
+}
+
+/*
+ * Displays a value for a data item with prec decimal places, after
+ * quantizing it and applying the item's hysteresis. The hysteresis is
+ * measured from the last real value shown, and a prediction on the display is
+ * always replaced
+ */
+static void
+show(hud_data_t8 d, int32_t v, uint8_t prec)
+{
+    int8_t dir;
+
+    v = quantize(d, v);
+
+    if (hud_data[d].value[0] != '\0') {
+        if (v != hud_data[d].shown) {
+            dir = (v > hud_data[d].shown) ? 1 : -1;
+
+            if (dir != hud_data[d].dir &&
+                    labs(v - hud_data[d].shown) <= data_def[d].hyst)
+                v = hud_data[d].shown;
+            else
+                hud_data[d].dir = dir;
+        }
 
-static bool avg_econ_updated;
-static struct timer avg_econ_timer;
-static uint32_t avg_econ_num_writes;
+        if (v == hud_data[d].shown && !hud_data[d].predicted)
+            return;
+    }
 
-static float last_speed_kph = 0.0f;
-static float last_inst_econ = 0.0f;
-static uint8_t last_fuel_lvl = 100;
+    hud_data[d].shown = v;
+    hud_data[d].predicted = false;
+    FMT_fixed(hud_data[d].value, sizeof(hud_data[d].value), v, prec, 0, 0);
+}
 
-static float
-cont_filter(float input, float old_val, float constant)
+/*
+ * Displays a predicted value for a data item. Predictions aren't held back by
+ * hysteresis, and don't move the value the hysteresis is measured from
+ */
+static void
+show_prediction(hud_data_t8 d, int32_t v, uint8_t prec)
 {
-    return ((input + old_val) * (1.0f - constant) ) / 2.0f + constant * old_val;
+    hud_data[d].predicted = true;
+    FMT_fixed(hud_data[d].value, sizeof(hud_data[d].value), quantize(d, v),
+            prec, 0, 0);
 }
 
+/*
+ * Displays a newly calculated value for a data item and tracks its
+ * statistics. Statistics are kept from the unquantized value
+ */
 static void
-set_float(hud_data_t8 d, float v, uint8_t precision)
+publish(hud_data_t8 d, int32_t v, uint8_t prec)
 {
-    char *cur;
-    bool in_dec = false;
-    uint8_t dec_cnt = 0;
-    char buf[50];
-    snprintf(buf, sizeof(buf), "%f", (double)v);
+    show(d, v, prec);
 
-    strlcpy(hud_data[d].value, buf, sizeof(hud_data[d].value));
+    if (hud_data[d].stats != NO_STATS)
+        update_stats(hud_data[d].stats, v, prec);
+}
 
-    cur = hud_data[d].value;
+/*
+ * Publishes a newly calculated value for a data item, after passing it
+ * through the item's filter
+ */
+static void
+set_value(hud_data_t8 d, int32_t v)
+{
+    uint8_t e = hud_data[d].extrap;
 
-    while (*cur) {
-        if (*cur == '.') {
-            if (precision == 0) {
-                *cur ='\0';
-                break;
-            }
+    if (hud_data[d].filt != NO_FILTER)
+        v = FILTER_apply(data_def[d].filter, data_def[d].tau,
+                &filters[hud_data[d].filt], v, timer_get());
 
-            in_dec = true;
-        } else if (in_dec) {
-            if (dec_cnt == precision) {
-                *cur = '\0';
-                break;
-            }
-            dec_cnt++;
+    if (e != NO_EXTRAP) {
+        if (extraps[e].cnt == 2) {
+            extraps[e].time[0] = extraps[e].time[1];
+            extraps[e].value[0] = extraps[e].value[1];
+        } else {
+            extraps[e].cnt++;
         }
 
-        cur++;
+        /*
+         * Samples are timed from when their PID's response was decoded, since
+         * the item may be calculated some time later
+         */
+        extraps[e].time[extraps[e].cnt - 1] = data_def[d].cnt ?
+            OBD_get_time(data_def[d].pids[0]) : timer_get();
+        extraps[e].value[extraps[e].cnt - 1] = v;
     }
+
+    publish(d, v, data_def[d].prec);
+}
+
+/*
+ * Publishes a linear prediction for an extrapolated data item from its last
+ * two samples. The prediction is bounded to one sample period past the last
+ * sample, and is clamped so it doesn't cross zero when both samples are on
+ * the same side of it (e.g. a decelerating vehicle isn't shown going
+ * backwards). The next real sample replaces it.
+ *
+ * Predictions aren't included in the item's statistics
+ */
+static void
+extrapolate(hud_data_t8 d)
+{
+    uint8_t e = hud_data[d].extrap;
+    uint32_t span;
+    uint32_t dt;
+    int32_t v;
+    char old_data[HUD_DATA_LEN];
+
+    if (extraps[e].cnt < 2)
+        return;
+
+    span = extraps[e].time[1] - extraps[e].time[0];
+    dt = timer_get() - extraps[e].time[1];
+
+    if (span == 0)
+        return;
+
+    dt = minval(dt, minval(span, EXTRAP_MAX_TIME));
+
+    v = extraps[e].value[1] + (extraps[e].value[1] - extraps[e].value[0]) *
+        (int32_t)dt / (int32_t)span;
+
+    if (extraps[e].value[0] >= 0 && extraps[e].value[1] >= 0 && v < 0)
+        v = 0;
+    else if (extraps[e].value[0] <= 0 && extraps[e].value[1] <= 0 && v > 0)
+        v = 0;
+
+    memcpy(old_data, hud_data[d].value, HUD_DATA_LEN);
+
+    show_prediction(d, v, data_def[d].prec);
+
+    if (strcmp(old_data, hud_data[d].value) != 0)
+        hud_data[d].updated = true;
 }
 
+/*
+ * Publishes predictions for all the valid extrapolated data items
+ */
 static void
-set_int(hud_data_t8 d, uint32_t v)
+extrapolate_items(void)
 {
-    snprintf(hud_data[d].value, sizeof(hud_data[d].value), "%lu", v);
+    hud_data_t8 d;
+
+    if (!extraps_used || timer_get() - extrap_time < EXTRAP_INTVL)
+        return;
+
+    extrap_time = timer_get();
+
+    for (d = 0; d < HUD_DATA_CNT; d++) {
+        if (hud_data[d].extrap != NO_EXTRAP && hud_data[d].valid)
+            extrapolate(d);
+    }
 }
 
 static void
-set_int_F(hud_data_t8 idx, float val_C)
+set_value_F(hud_data_t8 idx, int16_t val_C)
 {
-    set_int(idx, (int32_t)(val_C * 1.8f) + 32);
+    set_value(idx, val_C * 9 / 5 + 32);
 }
 
-static float
-get_fuel_econ(float speed, float maf)
+/*
+ * Calculates fuel economy in 0.1 MPG from a speed in kph and a mass air flow
+ * in 0.01 g/s, both with the same number of fractional bits
+ */
+static uint16_t
+get_fuel_econ(uint32_t speed, uint32_t maf)
 {
-    /*
-     * 14.7 grams of air to 1 gram of gasoline - ideal air/fuel ratio
-     * 6.073 pounds per gallon - density of gasoline
-     * 453.59 grams per pound - conversion
-     * 0.621371 miles per hour/kilometers per hour - conversion
-     * 3600 seconds per hour - conversion
-     */
-    return (14.7f * 6.073f * 453.59 * speed * KPH_TO_MPH) / (float)(3600 * maf);
+    return minval(ECON_K * speed / maf / 10, ECON_MAX);
 }
 
 static void
 calc_speed_mph(hud_data_t8 idx)
 {
-    set_int(idx, OBD_get_speed() * KPH_TO_MPH);
+    set_value(idx, (OBD_get_speed() * KPH_TO_MPH_Q16) >> Q16_SHIFT);
 }
 
 static void
 calc_speed_kph(hud_data_t8 idx)
 {
-    last_speed_kph = cont_filter(OBD_get_speed(), last_speed_kph,
-            SPD_FILTER_CONSTANT);
-    set_int(idx, last_speed_kph);
+    set_value(idx, OBD_get_speed());
 }
 
 static void
 calc_uncal_spd(hud_data_t8 idx)
 {
-    set_int(idx, OBD_get_uncal_speed());
+    set_value(idx, OBD_get_uncal_speed());
 }
 
 static void
 calc_rpm(hud_data_t8 idx)
 {
-    set_int(idx, OBD_get_rpm());
+    set_value(idx, OBD_get_rpm());
 }
 
 static void
 calc_inst_econ(hud_data_t8 idx)
 {
-    float maf_rate = OBD_get_MAF_rate();
-    if (maf_rate != 0.0f) {
-        last_inst_econ = cont_filter(
-                get_fuel_econ(OBD_get_speed(), maf_rate),
-                last_inst_econ, INST_FUEL_CONSTANT);
-        set_float(idx, last_inst_econ, 1);
+    uint16_t maf_rate = OBD_get_MAF_rate();
+    if (maf_rate != 0)
+        set_value(idx, get_fuel_econ(OBD_get_speed(), maf_rate));
+}
+
+/*
+ * Gets the average fuel economy over the trip in 0.1 MPG, from the total
+ * distance and fuel used. Returns false if no fuel has been used
+ */
+static bool
+get_trip_econ(uint16_t *econ)
+{
+    uint32_t dist;
+    uint32_t fuel;
+
+    dist = TRIP_get_dist();
+    fuel = TRIP_get_fuel();
+
+    /*
+     * Scale both down until the calculation fits in 32 bits
+     */
+    while (dist > UINT32_MAX / TRIP_ECON_K) {
+        dist >>= 1;
+        fuel >>= 1;
     }
+
+    if (fuel == 0)
+        return false;
+
+    *econ = minval(TRIP_ECON_K * dist / fuel, ECON_MAX);
+    return true;
 }
 
 static void
 calc_avg_econ(hud_data_t8 idx)
 {
-    float ratio;
+    uint16_t econ;
 
-    if (avg_samples == 0) {
-        avg_econ_spd = OBD_get_speed();
-        avg_econ_rate = OBD_get_MAF_rate();
-    } else {
-        ratio = ((float)avg_samples) / (avg_samples + 1);
-        avg_econ_spd = cont_filter(OBD_get_speed(), avg_econ_spd, ratio);
-        avg_econ_rate = cont_filter(OBD_get_MAF_rate(), avg_econ_rate, ratio);
-    }
+    if (get_trip_econ(&econ))
+        set_value(idx, econ);
+}
 
-    if (avg_econ_rate != 0.0f) {
-        set_float(idx, get_fuel_econ(avg_econ_spd, avg_econ_rate), 1);
+static void
+calc_trip_dist(hud_data_t8 idx)
+{
+    set_value(idx, ((TRIP_get_dist() / 100) * KPH_TO_MPH_Q16) >> Q16_SHIFT);
+}
 
-        avg_econ_updated = true;
+static void
+calc_trip_fuel(hud_data_t8 idx)
+{
+    set_value(idx, TRIP_get_fuel() / MG_PER_CGAL);
+}
 
-        if (avg_samples + 1 < MAX_AVG_SAMPLES)
-            avg_samples++;
-    }
+static void
+calc_trip_time(hud_data_t8 idx)
+{
+    set_value(idx, TRIP_get_time() / (60ul * 1000ul));
 }
 
 static void
 calc_timer(hud_data_t8 idx)
 {
-    set_int(idx, timer_get() / 1000);
+    set_value(idx, timer_get() / 1000);
 }
 
+/*
+ * The fuel level is the level fitted to the samples since the last refuel,
+ * rounded to the nearest percent
+ */
 static void
 calc_fuel_lvl(hud_data_t8 idx)
 {
-    uint8_t l;
+    uint16_t l;
+
+    if (FUEL_get_level(timer_get(), &l))
+        set_value(idx, (l + 128) >> 8);
+    else
+        hud_data[idx].valid = false;
+}
+
+/*
+ * Range to empty in miles, from the fuel remaining and the trip economy
+ */
+static void
+calc_range(hud_data_t8 idx)
+{
+    uint16_t fuel;
+    uint16_t econ;
+
+    if (FUEL_get_remaining(timer_get(), &fuel) && get_trip_econ(&econ))
+        set_value(idx, (uint32_t)fuel * econ / 1000);
+    else
+        hud_data[idx].valid = false;
+}
+
+/*
+ * Performance run times, in 0.01 seconds
+ */
+static void
+calc_perf(hud_data_t8 idx)
+{
+    uint32_t t;
+
+    if (PERF_get_time(idx - HUD_DATA_PERF_60_MPH, &t))
+        set_value(idx, (t + 5) / 10);
+    else
+        hud_data[idx].valid = false;
+}
+
+static void
+calc_perf_intvl(hud_data_t8 idx)
+{
+    uint16_t intvl;
 
-    l = OBD_get_fuel_lvl();
+    if (PERF_get_smp_intvl(&intvl))
+        set_value(idx, intvl);
+    else
+        hud_data[idx].valid = false;
+}
 
-    if (l < last_fuel_lvl)
-        last_fuel_lvl = l;
+static void
+calc_shift_latency(hud_data_t8 idx)
+{
+    uint16_t latency;
 
-    set_int(idx, last_fuel_lvl);
+    if (SHIFT_get_latency(&latency))
+        set_value(idx, latency);
+    else
+        hud_data[idx].valid = false;
 }
 
 static void
 calc_econ_write(hud_data_t8 idx)
 {
-    set_int(idx, avg_econ_num_writes);
+    set_value(idx, TRIP_get_num_writes());
 }
 
 static void
 calc_last_pid(hud_data_t8 idx)
 {
-    set_int(idx, last_pid);
+    set_value(idx, last_pid);
+}
+
+static void
+calc_elm_idle(hud_data_t8 idx)
+{
+    set_value(idx, ELM327_get_idle_time());
 }
 
 static void
 calc_baro_pres_kpa(hud_data_t8 idx)
 {
-    set_int(idx, OBD_get_baro_pres());
+    set_value(idx, OBD_get_baro_pres());
 }
 
 static void
 calc_baro_pres_mmhg(hud_data_t8 idx)
 {
-    set_float(idx, OBD_get_baro_pres() * KPA_TO_MMHG, 0);
+    set_value(idx, (OBD_get_baro_pres() * KPA_TO_MMHG_Q16) >> Q16_SHIFT);
 }
 
 static void
 calc_air_temp_C(hud_data_t8 idx)
 {
-    set_int(idx, OBD_get_air_temp());
+    set_value(idx, OBD_get_air_temp());
 }
 
 static void
 calc_air_temp_F(hud_data_t8 idx)
 {
-    set_int_F(idx, OBD_get_air_temp());
+    set_value_F(idx, OBD_get_air_temp());
 }
 
 static void
@@ -278,256 +762,673 @@ calc_boost(hud_data_t8 idx)
      * Boost pressure is strange... Positive values are PSI, negative
      * are mmHg
      */
-    float value = OBD_get_intake_manifold_pres() - OBD_get_baro_pres();
+    int16_t value = (int16_t)OBD_get_intake_manifold_pres() -
+        OBD_get_baro_pres();
 
-    if (value >= 0.0)
-        set_float(idx, value * KPA_TO_PSI, 0);
+    if (value >= 0)
+        set_value(idx, (value * KPA_TO_PSI_Q16) >> Q16_SHIFT);
     else
-        set_float(idx, value * KPA_TO_MMHG, 0);
+        set_value(idx, -(int32_t)((-value * KPA_TO_MMHG_Q16) >> Q16_SHIFT));
 }
 
+/*
+ * User defined items are calculated by their formula
+ */
 static void
-avg_econ_write_clbk(void *param)
+calc_user(hud_data_t8 idx)
 {
-    uint8_t sig;
-    uint8_t i;
+    uint8_t f = idx - HUD_DATA_USER_1;
+    int32_t v;
 
-    if (avg_econ_updated) {
-        /*
-         * Write all the copies of the data
-         */
-        for (i = 0; i < cnt_of_array(avg_econ_ee_mem); i++) {
-            /*
-             * Write the invalid signature
-             */
-            sig = 0xFF;
-
-            eeprom_write_byte(&avg_econ_ee_mem[i].sig, sig);
-
-            /*
-             * Write the rest of the data
-             */
-            eeprom_write_word(&avg_econ_ee_mem[i].avg_samples,
-                    avg_samples);
-            eeprom_write_float(&avg_econ_ee_mem[i].avg_econ_rate,
-                    avg_econ_rate);
-            eeprom_write_float(&avg_econ_ee_mem[i].avg_econ_spd,
-                    avg_econ_spd);
-
-            /*
-             * Write the valid signature
-             */
-            sig = AVG_ECON_VALID_SIG;
-
-            eeprom_write_byte(&avg_econ_ee_mem[i].sig, sig);
-        }
+    if (FORMULA_eval(f, &v))
+        publish(idx, v, FORMULA_get_prec(f));
+    else
+        hud_data[idx].valid = false;
+}
 
-        avg_econ_num_writes++;
+/*
+ * Rolling averages are calculated from the totals over their window
+ */
+static void
+calc_roll_econ(hud_data_t8 idx)
+{
+    struct rolling_sums sums;
 
-        avg_econ_updated = false;
-    }
+    ROLLING_get(idx - HUD_DATA_ECON_1_MIN, &sums);
+
+    if (sums.fuel != 0)
+        set_value(idx, minval(TRIP_ECON_K * sums.dist / sums.fuel, ECON_MAX));
+    else
+        hud_data[idx].valid = false;
+}
+
+static void
+calc_roll_speed(hud_data_t8 idx)
+{
+    struct rolling_sums sums;
+
+    ROLLING_get(idx - HUD_DATA_SPEED_1_MIN, &sums);
 
     /*
-     * Create the timer for the next write cycle
+     * Meters per ms to kph is * 3600
      */
-    timer_create(&avg_econ_timer, AVG_ECON_WRITE_INTVL, avg_econ_write_clbk,
-            NULL);
+    if (sums.time != 0)
+        set_value(idx, ((sums.dist * 3600ul / sums.time) * KPH_TO_MPH_Q16)
+                >> Q16_SHIFT);
+    else
+        hud_data[idx].valid = false;
+}
+
+static void
+calc_roll_load(hud_data_t8 idx)
+{
+    struct rolling_sums sums;
+
+    ROLLING_get(idx - HUD_DATA_LOAD_1_MIN, &sums);
+
+    if (sums.load_time != 0)
+        set_value(idx, (sums.load << 8) / sums.load_time);
+    else
+        hud_data[idx].valid = false;
 }
 
 static void
 calc_coolant_temp_C(hud_data_t8 idx)
 {
-    set_int(idx, OBD_get_engn_clnt_temp());
+    set_value(idx, OBD_get_engn_clnt_temp());
 }
 
 static void
 calc_coolant_temp_F(hud_data_t8 idx)
 {
-    set_int_F(idx, OBD_get_engn_clnt_temp());
+    set_value_F(idx, OBD_get_engn_clnt_temp());
 }
 
 static void
 calc_oil_temp_C(hud_data_t8 idx)
 {
-    set_int(idx, OBD_get_engn_oil_temp());
+    set_value(idx, OBD_get_engn_oil_temp());
 }
 
 static void
 calc_oil_temp_F(hud_data_t8 idx)
 {
-    set_int_F(idx, OBD_get_engn_oil_temp());
+    set_value_F(idx, OBD_get_engn_oil_temp());
 }
 
 static const obd_pid_t8 speed_pids[]        = { OBD_PID_SPEED };
 static const obd_pid_t8 rpm_pids[]          = { OBD_PID_ENGN_RPM };
 static const obd_pid_t8 fuel_econ_pids[]    = { OBD_PID_MAF_RATE, OBD_PID_SPEED };
+static const obd_pid_t8 maf_pids[]          = { OBD_PID_MAF_RATE };
 static const obd_pid_t8 fuel_lvl_pids[]     = { OBD_PID_FUEL_LVL_INPUT };
 static const obd_pid_t8 baro_pres_pids[]    = { OBD_PID_BARO_PRES };
 static const obd_pid_t8 air_temp_pids[]     = { OBD_PID_AMBIENT_AIR_TEMP };
 static const obd_pid_t8 boost_pids[]        = { OBD_PID_BARO_PRES, OBD_PID_INTAKE_ABS_PRES };
 static const obd_pid_t8 coolant_temp_pids[] = { OBD_PID_ENGN_CLNT_TEMP };
 static const obd_pid_t8 oil_temp_pids[]     = { OBD_PID_ENGN_OIL_TEMP };
+static const obd_pid_t8 load_pids[]         = { OBD_PID_ENGN_LOAD };
 
-static const struct data_def_type data_def[] =
-{
-    /* HUD_DATA_NONE            */  { NULL, 0,              NULL,                   "None"          },
-    /* HUD_DATA_SPEED_MPH       */  { _s(speed_pids),       calc_speed_mph,         "MPH"           },
-    /* HUD_DATA_SPEED_KPH       */  { _s(speed_pids),       calc_speed_kph,         "KPH"           },
-    /* HUD_DATA_SPEED_UNCAL     */  { _s(speed_pids),       calc_uncal_spd,         "raw KPH"       },
-    /* HUD_DATA_RPM             */  { _s(rpm_pids),         calc_rpm,               "RPM"           },
-    /* HUD_DATA_INST_ECON       */  { _s(fuel_econ_pids),   calc_inst_econ,         "Inst MPG"      },
-    /* HUD_DATA_AVG_ECON        */  { _s(fuel_econ_pids),   calc_avg_econ,          "Avg MPG"       },
-    /* HUD_DATA_TIMER           */  { NULL, 0,              calc_timer,             "Timer"         },
-    /* HUD_DATA_FUEL_LVL        */  { _s(fuel_lvl_pids),    calc_fuel_lvl,          "Fuel lvl"      },
-    /* HUD_DATA_ECON_WRITE      */  { NULL, 0,              calc_econ_write,        "Fuel wrts"     },
-    /* HUD_DATA_LAST_PID        */  { NULL, 0,              calc_last_pid,          "Last PID"      },
-    /* HUD_DATA_BARO_PRES_KPA   */  { _s(baro_pres_pids),   calc_baro_pres_kpa,     "BP KPA"        },
-    /* HUD_DATA_BARO_PRES_MMHG  */  { _s(baro_pres_pids),   calc_baro_pres_mmhg,    "BP mmHG"       },
-    /* HUD_DATA_AIR_TEMP_C      */  { _s(air_temp_pids),    calc_air_temp_C,        "Outside C"     },
-    /* HUD_DATA_AIR_TEMP_F      */  { _s(air_temp_pids),    calc_air_temp_F,        "Outside F"     },
-    /* HUD_DATA_BOOST           */  { _s(boost_pids),       calc_boost,             "Boost"         },
-    /* HUD_DATA_COOLANT_TEMP_C  */  { _s(coolant_temp_pids),calc_coolant_temp_C,    "Coolant C"     },
-    /* HUD_DATA_COOLANT_TEMP_F  */  { _s(coolant_temp_pids),calc_coolant_temp_F,    "Coolant F"     },
-    /* HUD_DATA_OIL_TEMP_C      */  { _s(oil_temp_pids),    calc_oil_temp_C,        "Oil C"         },
-    /* HUD_DATA_OIL_TEMP_F      */  { _s(oil_temp_pids),    calc_oil_temp_F,        "Oil F"         },
+static const struct data_def_type data_def[HUD_DATA_CNT] =
+{
+    /* HUD_DATA_NONE            */  { NULL, 0,                  0,      0,      0,  0,  0,   0,   FILTER_NONE,       0,    0,          NULL,                   "None"          },
+    /* HUD_DATA_SPEED_MPH       */  { _s(speed_pids),           100,    1000,   3,  0,  1,   1,   FILTER_ALPHA_BETA, 500,  DEF_EXTRAP, calc_speed_mph,         "MPH"           },
+    /* HUD_DATA_SPEED_KPH       */  { _s(speed_pids),           100,    1000,   3,  0,  1,   1,   FILTER_ALPHA_BETA, 500,  DEF_EXTRAP, calc_speed_kph,         "KPH"           },
+    /* HUD_DATA_SPEED_UNCAL     */  { _s(speed_pids),           100,    1000,   3,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_uncal_spd,         "raw KPH"       },
+    /* HUD_DATA_RPM             */  { _s(rpm_pids),             100,    500,    3,  0,  100, 100, FILTER_NONE,       0,    DEF_EXTRAP, calc_rpm,               "RPM"           },
+    /* HUD_DATA_INST_ECON       */  { _s(fuel_econ_pids),       200,    1000,   2,  1,  1,   2,   FILTER_EMA,        1000, DEF_GROUP,  calc_inst_econ,         "Inst MPG"      },
+    /* HUD_DATA_AVG_ECON        */  { _s(fuel_econ_pids),       1000,   5000,   1,  1,  1,   1,   FILTER_NONE,       0,    0,          calc_avg_econ,          "Avg MPG"       },
+    /* HUD_DATA_TIMER           */  { NULL, 0,                  0,      0,      0,  0,  0,   0,   FILTER_NONE,       0,    0,          calc_timer,             "Timer"         },
+    /* HUD_DATA_FUEL_LVL        */  { _s(fuel_lvl_pids),        5000,   30000,  0,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_fuel_lvl,          "Fuel lvl"      },
+    /* HUD_DATA_ECON_WRITE      */  { NULL, 0,                  0,      0,      0,  0,  0,   0,   FILTER_NONE,       0,    0,          calc_econ_write,        "Fuel wrts"     },
+    /* HUD_DATA_LAST_PID        */  { NULL, 0,                  0,      0,      0,  0,  0,   0,   FILTER_NONE,       0,    0,          calc_last_pid,          "Last PID"      },
+    /* HUD_DATA_BARO_PRES_KPA   */  { _s(baro_pres_pids),       10000,  60000,  0,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_baro_pres_kpa,     "BP KPA"        },
+    /* HUD_DATA_BARO_PRES_MMHG  */  { _s(baro_pres_pids),       10000,  60000,  0,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_baro_pres_mmhg,    "BP mmHG"       },
+    /* HUD_DATA_AIR_TEMP_C      */  { _s(air_temp_pids),        5000,   30000,  0,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_air_temp_C,        "Outside C"     },
+    /* HUD_DATA_AIR_TEMP_F      */  { _s(air_temp_pids),        5000,   30000,  0,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_air_temp_F,        "Outside F"     },
+    /* HUD_DATA_BOOST           */  { _s(boost_pids),           100,    500,    3,  0,  1,   1,   FILTER_MEDIAN,     0,    DEF_GROUP,  calc_boost,             "Boost"         },
+    /* HUD_DATA_COOLANT_TEMP_C  */  { _s(coolant_temp_pids),    2000,   10000,  0,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_coolant_temp_C,    "Coolant C"     },
+    /* HUD_DATA_COOLANT_TEMP_F  */  { _s(coolant_temp_pids),    2000,   10000,  0,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_coolant_temp_F,    "Coolant F"     },
+    /* HUD_DATA_OIL_TEMP_C      */  { _s(oil_temp_pids),        2000,   10000,  0,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_oil_temp_C,        "Oil C"         },
+    /* HUD_DATA_OIL_TEMP_F      */  { _s(oil_temp_pids),        2000,   10000,  0,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_oil_temp_F,        "Oil F"         },
+    /* HUD_DATA_ELM_IDLE        */  { NULL, 0,                  0,      0,      0,  0,  0,   0,   FILTER_NONE,       0,    0,          calc_elm_idle,          "ELM idle"      },
+    /* HUD_DATA_TRIP_DIST       */  { _s(speed_pids),           1000,   5000,   1,  1,  0,   0,   FILTER_NONE,       0,    0,          calc_trip_dist,         "Trip mi"       },
+    /* HUD_DATA_TRIP_FUEL       */  { _s(maf_pids),             1000,   5000,   1,  2,  0,   0,   FILTER_NONE,       0,    0,          calc_trip_fuel,         "Fuel gal"      },
+    /* HUD_DATA_TRIP_TIME       */  { _s(speed_pids),           1000,   5000,   0,  0,  0,   0,   FILTER_NONE,       0,    0,          calc_trip_time,         "Trip min"      },
+    /* HUD_DATA_USER_1          */  { NULL, 0,                  200,    2000,   2,  0,  0,   0,   FILTER_NONE,       0,    0,          calc_user,              "User 1"        },
+    /* HUD_DATA_USER_2          */  { NULL, 0,                  200,    2000,   2,  0,  0,   0,   FILTER_NONE,       0,    0,          calc_user,              "User 2"        },
+    /* HUD_DATA_USER_3          */  { NULL, 0,                  200,    2000,   2,  0,  0,   0,   FILTER_NONE,       0,    0,          calc_user,              "User 3"        },
+    /* HUD_DATA_USER_4          */  { NULL, 0,                  200,    2000,   2,  0,  0,   0,   FILTER_NONE,       0,    0,          calc_user,              "User 4"        },
+    /* HUD_DATA_ECON_1_MIN      */  { _s(fuel_econ_pids),       1000,   5000,   1,  1,  1,   1,   FILTER_NONE,       0,    0,          calc_roll_econ,         "MPG 1m"        },
+    /* HUD_DATA_ECON_5_MIN      */  { _s(fuel_econ_pids),       1000,   5000,   1,  1,  1,   1,   FILTER_NONE,       0,    0,          calc_roll_econ,         "MPG 5m"        },
+    /* HUD_DATA_ECON_15_MIN     */  { _s(fuel_econ_pids),       1000,   5000,   1,  1,  1,   1,   FILTER_NONE,       0,    0,          calc_roll_econ,         "MPG 15m"       },
+    /* HUD_DATA_SPEED_1_MIN     */  { _s(speed_pids),           1000,   5000,   1,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_roll_speed,        "MPH 1m"        },
+    /* HUD_DATA_SPEED_5_MIN     */  { _s(speed_pids),           1000,   5000,   1,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_roll_speed,        "MPH 5m"        },
+    /* HUD_DATA_SPEED_15_MIN    */  { _s(speed_pids),           1000,   5000,   1,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_roll_speed,        "MPH 15m"       },
+    /* HUD_DATA_LOAD_1_MIN      */  { _s(load_pids),            500,    2000,   1,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_roll_load,         "Load 1m"       },
+    /* HUD_DATA_LOAD_5_MIN      */  { _s(load_pids),            500,    2000,   1,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_roll_load,         "Load 5m"       },
+    /* HUD_DATA_LOAD_15_MIN     */  { _s(load_pids),            500,    2000,   1,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_roll_load,         "Load 15m"      },
+    /* HUD_DATA_RANGE           */  { _s(fuel_lvl_pids),        5000,   30000,  0,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_range,             "Range mi"      },
+    /* HUD_DATA_PERF_60_MPH     */  { _s(speed_pids),           100,    1000,   3,  2,  0,   0,   FILTER_NONE,       0,    0,          calc_perf,              "0-60 mph"      },
+    /* HUD_DATA_PERF_100_KPH    */  { _s(speed_pids),           100,    1000,   3,  2,  0,   0,   FILTER_NONE,       0,    0,          calc_perf,              "0-100 kph"     },
+    /* HUD_DATA_PERF_QTR_MILE   */  { _s(speed_pids),           100,    1000,   3,  2,  0,   0,   FILTER_NONE,       0,    0,          calc_perf,              "1/4 mile"      },
+    /* HUD_DATA_PERF_INTVL      */  { _s(speed_pids),           100,    1000,   3,  0,  0,   0,   FILTER_NONE,       0,    0,          calc_perf_intvl,        "Perf ms"       },
+    /* HUD_DATA_SHIFT_LATENCY   */  { _s(rpm_pids),             50,     200,    3,  0,  1,   1,   FILTER_NONE,       0,    0,          calc_shift_latency,     "Shift ms"      },
 };
 
 STATIC_ASSERT(cnt_of_array(data_def) == HUD_DATA_CNT);
+STATIC_ASSERT(HUD_DATA_USER_4 - HUD_DATA_USER_1 + 1 == FORMULA_CNT);
+STATIC_ASSERT(HUD_DATA_PERF_QTR_MILE - HUD_DATA_PERF_60_MPH + 1 ==
+        PERF_MARK_CNT);
 
-static void
-check_data(hud_data_t8 d, obd_pid_t8 pid)
+/*
+ * Gets the PIDs that a data item depends on. These come from the item's
+ * formula for user defined items
+ */
+static uint8_t
+item_pids(hud_data_t8 d, obd_pid_t8 const **pids)
 {
-    uint8_t k;
-    bool valid;
-    char old_data[HUD_DATA_LEN];
+    if (d >= HUD_DATA_USER_1 && d <= HUD_DATA_USER_4)
+        return FORMULA_get_pids(d - HUD_DATA_USER_1, pids);
 
-    valid = true;
+    *pids = data_def[d].pids;
+    return data_def[d].cnt;
+}
 
-    if (hud_data[d].watched) {
-        if (data_def[d].cnt == 0) {
-            valid = true;
-        } else {
-            for (k = 0; k < data_def[d].cnt; k++) {
-                if (!OBD_is_valid(data_def[d].pids[k]))
-                    valid = false;
-            }
-        }
+/*
+ * Recalculates a data item. Returns true if the displayed value changed
+ */
+static bool
+calc_data(hud_data_t8 d)
+{
+    char old_data[HUD_DATA_LEN];
 
-        hud_data[d].valid = valid;
+    hud_data[d].valid = true;
 
-        /*
-         * Calculate a new value if this data value is valid, and it either has
-         * no dependant PID's, or the first PID in the list is the one we are
-         * checking. Note that we don't check if any PID in the list is equal
-         * to the updated one, because it would cause the calculation to be run
-         * multiple times and each time only one data value could possibly
-         * change
-         */
-        if (valid && (data_def[d].cnt == 0 || data_def[d].pids[0] == pid)) {
-            if (data_def[d].calc_func) {
-                memcpy(old_data, hud_data[d].value, HUD_DATA_LEN);
+    if (!data_def[d].calc_func)
+        return false;
 
-                data_def[d].calc_func(d);
+    memcpy(old_data, hud_data[d].value, HUD_DATA_LEN);
 
-                if (strcmp(old_data, hud_data[d].value) != 0)
-                    hud_data[d].updated = true;
-            }
+    data_def[d].calc_func(d);
+
+    if (strcmp(old_data, hud_data[d].value) != 0) {
+        hud_data[d].updated = true;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Recalculates all the watched data items that don't depend on any PIDs
+ */
+static void
+calc_no_pid_items(void)
+{
+    hud_data_t8 d;
+    uint64_t items;
+
+    for (d = 0, items = no_pid_items; items; d++, items >>= 1) {
+        if (items & 1)
+            calc_data(d);
+    }
+}
+
+static bool
+stale_before(uint8_t a, uint8_t b)
+{
+    return (int32_t)(sched[a].stale_time - sched[b].stale_time) < 0;
+}
+
+static void
+heap_sift_down(uint8_t pos)
+{
+    uint8_t child;
+    uint8_t tmp;
+
+    while ((child = pos * 2 + 1) < sched_cnt) {
+        if (child + 1 < sched_cnt &&
+                stale_before(stale_heap[child + 1], stale_heap[child]))
+            child++;
+
+        if (!stale_before(stale_heap[child], stale_heap[pos]))
+            break;
+
+        tmp = stale_heap[pos];
+        stale_heap[pos] = stale_heap[child];
+        stale_heap[child] = tmp;
+
+        sched[stale_heap[pos]].heap_pos = pos;
+        sched[stale_heap[child]].heap_pos = child;
+
+        pos = child;
+    }
+}
+
+static void
+heap_build(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < sched_cnt; i++) {
+        stale_heap[i] = i;
+        sched[i].heap_pos = i;
+    }
+
+    for (i = sched_cnt / 2; i > 0; i--)
+        heap_sift_down(i - 1);
+}
+
+/*
+ * Returns when a value of a schedule slot received at a time goes stale
+ */
+static uint32_t
+stale_at(uint8_t i, uint32_t time)
+{
+    return time + ((uint32_t)sched[i].intvl_max << STALE_SHIFT);
+}
+
+/*
+ * Updates when the value of a schedule slot goes stale from the time it was
+ * received. Values only get newer, so the slot can only move down the heap
+ */
+static void
+set_stale_time(uint8_t i, uint32_t time)
+{
+    sched[i].stale_time = stale_at(i, time);
+    heap_sift_down(sched[i].heap_pos);
+}
+
+static bool
+is_stale(uint8_t i)
+{
+    return (int32_t)(timer_get() - sched[i].stale_time) >= 0;
+}
+
+/*
+ * Returns true if a PID's samples are integrated over time
+ */
+static bool
+is_integrated(obd_pid_t8 pid)
+{
+    return pid == OBD_PID_SPEED || pid == OBD_PID_MAF_RATE ||
+        pid == OBD_PID_ENGN_LOAD;
+}
+
+/*
+ * Rebuilds the list of PIDs to poll from the watched data items. Each PID is
+ * refreshed at the fastest interval and highest priority of the items that
+ * use it.
+ *
+ * This also builds the dependency index: each schedule slot has a bitmask of
+ * the data items that use its PID, and each data item has a bitmask of the
+ * slots it depends on. When a response arrives only the items that depend on
+ * it need to be looked at, and their validity is a single mask test against
+ * the slots that currently hold valid data
+ */
+static void
+update_sched(void)
+{
+    struct sched_type old_sched[MAX_SCHED_PIDS];
+    uint8_t old_cnt;
+    hud_data_t8 d;
+    uint8_t i;
+    uint8_t j;
+    uint16_t intvl_min;
+    uint16_t intvl_max;
+    obd_pid_t8 pid;
+    obd_pid_t8 const *pids;
+    uint8_t cnt;
+
+    memcpy(old_sched, sched, sizeof(old_sched));
+    old_cnt = sched_cnt;
+    sched_cnt = 0;
+    no_pid_items = 0;
+
+    for (d = 0; d < HUD_DATA_CNT; d++) {
+        hud_data[d].deps = 0;
+
+        if (!hud_data[d].watched)
+            continue;
+
+        cnt = item_pids(d, &pids);
+
+        if (cnt == 0)
+            no_pid_items |= (uint64_t)1 << d;
+
+        intvl_min = data_def[d].intvl_min;
+        intvl_max = data_def[d].intvl_max;
+
+        if (!hud_data[d].visible) {
+            intvl_min = minval((uint32_t)intvl_min << HIDDEN_INTVL_SHIFT,
+                    UINT16_MAX);
+            intvl_max = minval((uint32_t)intvl_max << HIDDEN_INTVL_SHIFT,
+                    UINT16_MAX);
+        }
+
+        for (i = 0; i < cnt; i++) {
+            pid = pids[i];
+
+            for (j = 0; j < sched_cnt && sched[j].pid != pid; j++)
+                ;
+
+            if (j == sched_cnt) {
+                if (sched_cnt == MAX_SCHED_PIDS) {
+                    hud_data[d].deps |= SCHED_UNAVAIL;
+                    continue;
+                }
+
+                sched_cnt++;
+                sched[j].pid = pid;
+                sched[j].prio = data_def[d].prio;
+                sched[j].intvl_min = intvl_min;
+                sched[j].intvl_max = intvl_max;
+                sched[j].deadline = timer_get();
+                sched[j].group = (uint16_t)1 << j;
+                sched[j].items = 0;
+            } else {
+                sched[j].prio = maxval(sched[j].prio, data_def[d].prio);
+                sched[j].intvl_min = minval(sched[j].intvl_min, intvl_min);
+                sched[j].intvl_max = minval(sched[j].intvl_max, intvl_max);
+            }
+
+            hud_data[d].deps |= (uint16_t)1 << j;
+            sched[j].items |= (uint64_t)1 << d;
         }
     }
+
+    /*
+     * Each slot used by a grouped item is requested along with the item's
+     * other slots
+     */
+    for (d = 0; d < HUD_DATA_CNT; d++) {
+        if (!hud_data[d].watched || !(data_def[d].flags & DEF_GROUP))
+            continue;
+
+        for (j = 0; j < sched_cnt; j++) {
+            if (hud_data[d].deps & ((uint16_t)1 << j))
+                sched[j].group |= hud_data[d].deps & ~SCHED_UNAVAIL;
+        }
+    }
+
+    group_pending = 0;
+    group_fresh = 0;
+    sched_changed = 0;
+
+    /*
+     * New PIDs start at their fastest interval. Keep the deadlines and learned
+     * state of PIDs that were already being polled
+     */
+    sched_valid = 0;
+
+    for (i = 0; i < sched_cnt; i++) {
+        if (OBD_is_valid(sched[i].pid))
+            sched_valid |= (uint16_t)1 << i;
+
+        if (is_integrated(sched[i].pid)) {
+            sched[i].intvl_min = minval(sched[i].intvl_min,
+                    INTEGRATED_INTVL_MAX);
+            sched[i].intvl_max = minval(sched[i].intvl_max,
+                    INTEGRATED_INTVL_MAX);
+        }
+
+        sched[i].intvl_max = maxval(sched[i].intvl_max, sched[i].intvl_min);
+        sched[i].intvl = sched[i].intvl_min;
+        sched[i].chg_rate = CHG_RATE_HI;
+        sched[i].last_value = OBD_get_value(sched[i].pid);
+        sched[i].last_time = OBD_get_time(sched[i].pid);
+        sched[i].rate = 0;
+
+        for (j = 0; j < old_cnt; j++) {
+            if (old_sched[j].pid == sched[i].pid) {
+                sched[i].deadline = old_sched[j].deadline;
+                sched[i].chg_rate = old_sched[j].chg_rate;
+                sched[i].rate = old_sched[j].rate;
+                sched[i].intvl = minval(maxval(old_sched[j].intvl,
+                            sched[i].intvl_min), sched[i].intvl_max);
+            }
+        }
+
+        sched[i].stale_time = stale_at(i, OBD_get_time(sched[i].pid));
+    }
+
+    heap_build();
+
+    /*
+     * Slots have moved, so recheck validity. Items only become valid when
+     * they are next calculated
+     */
+    for (d = 0; d < HUD_DATA_CNT; d++) {
+        if (hud_data[d].deps & ~sched_valid)
+            hud_data[d].valid = false;
+    }
 }
 
+/*
+ * Gives a data item filter state from the pool, if it uses a filter. If the
+ * pool is exhausted the item is shown unfiltered
+ */
+static void
+alloc_filter(hud_data_t8 d)
+{
+    uint8_t i;
 
-void
-HUD_data_add(hud_data_t8 d)
+    hud_data[d].filt = NO_FILTER;
+
+    if (data_def[d].filter == FILTER_NONE)
+        return;
+
+    for (i = 0; i < MAX_FILTERS; i++) {
+        if (!(filters_used & _BV(i))) {
+            filters_used |= _BV(i);
+            FILTER_reset(&filters[i]);
+            hud_data[d].filt = i;
+            break;
+        }
+    }
+}
+
+static void
+free_filter(hud_data_t8 d)
+{
+    if (hud_data[d].filt != NO_FILTER)
+        filters_used &= ~_BV(hud_data[d].filt);
+
+    hud_data[d].filt = NO_FILTER;
+}
+
+/*
+ * Gives a data item extrapolation state from the pool, if it is
+ * extrapolated. If the pool is exhausted the item only changes when it is
+ * sampled
+ */
+static void
+alloc_extrap(hud_data_t8 d)
 {
     uint8_t i;
 
-    if (!hud_data[d].watched) {
-        for (i = 0; i < data_def[d].cnt; i++)
-            pid_ref_cnt[data_def[d].pids[i]]++;
+    hud_data[d].extrap = NO_EXTRAP;
+
+    if (!(data_def[d].flags & DEF_EXTRAP))
+        return;
+
+    for (i = 0; i < MAX_EXTRAPS; i++) {
+        if (!(extraps_used & _BV(i))) {
+            extraps_used |= _BV(i);
+            extraps[i].cnt = 0;
+            hud_data[d].extrap = i;
+            break;
+        }
+    }
+}
+
+static void
+free_extrap(hud_data_t8 d)
+{
+    if (hud_data[d].extrap != NO_EXTRAP)
+        extraps_used &= ~_BV(hud_data[d].extrap);
+
+    hud_data[d].extrap = NO_EXTRAP;
+}
 
+static void
+watch(hud_data_t8 d, bool visible)
+{
+    if (!hud_data[d].watched) {
         hud_data[d].valid = false;
 
         /*
          * Mark data as updated so we show it as soon as it is valid
          */
         hud_data[d].updated = true;
+
+        /*
+         * Nothing is shown yet, so the first value isn't held back by
+         * hysteresis
+         */
+        hud_data[d].value[0] = '\0';
+        hud_data[d].dir = 0;
+        hud_data[d].predicted = false;
+
+        alloc_filter(d);
+        alloc_extrap(d);
     }
 
     hud_data[d].watched++;
+    if (visible)
+        hud_data[d].visible++;
+
+    update_sched();
 }
 
-bool
-HUD_data_remove(hud_data_t8 d)
+static bool
+unwatch(hud_data_t8 d, bool visible)
 {
-    uint8_t i;
-
     hud_data[d].watched--;
+    if (visible)
+        hud_data[d].visible--;
 
     if (!hud_data[d].watched) {
-        for (i = 0; i < data_def[d].cnt; i++)
-            pid_ref_cnt[data_def[d].pids[i]]--;
+        free_filter(d);
+        free_extrap(d);
+    }
 
-        return true;
+    update_sched();
+
+    return !hud_data[d].watched;
+}
+
+/*
+ * Starts tracking statistics for a data item, taking a slot from the pool if
+ * it isn't already tracked. If the pool is exhausted the statistics variants
+ * of the item are never valid
+ */
+static void
+track(hud_data_t8 d)
+{
+    uint8_t i;
+
+    if (hud_data[d].stats_refs++)
+        return;
+
+    for (i = 0; i < MAX_STATS; i++) {
+        if (!(stats_used & _BV(i))) {
+            stats_used |= _BV(i);
+            stats[i].valid = false;
+            stats[i].updated = 0;
+            hud_data[d].stats = i;
+            break;
+        }
     }
+}
 
-    return false;
+static void
+untrack(hud_data_t8 d)
+{
+    if (--hud_data[d].stats_refs)
+        return;
+
+    if (hud_data[d].stats != NO_STATS)
+        stats_used &= ~_BV(hud_data[d].stats);
+
+    hud_data[d].stats = NO_STATS;
+}
+
+void
+HUD_data_add(hud_data_t8 d)
+{
+    watch(HUD_data_item(d), true);
+
+    if (HUD_data_var(d) != HUD_VAR_CUR)
+        track(HUD_data_item(d));
+}
+
+bool
+HUD_data_remove(hud_data_t8 d)
+{
+    if (HUD_data_var(d) != HUD_VAR_CUR)
+        untrack(HUD_data_item(d));
+
+    return unwatch(HUD_data_item(d), true);
+}
+
+/*
+ * Clears the statistics of all tracked data items
+ */
+void
+HUD_stats_reset(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < MAX_STATS; i++)
+        stats[i].valid = false;
 }
 
 void
 HUD_data_init(void)
 {
     uint8_t i;
-    uint8_t sig;
 
     OBD_data_init();
 
+    burst.pid = OBD_PID_CNT;
+
     for (i = 0; i < HUD_DATA_CNT; i++) {
         hud_data[i].watched = 0;
+        hud_data[i].visible = 0;
         hud_data[i].valid = false;
         hud_data[i].updated = false;
+        hud_data[i].deps = 0;
+        hud_data[i].filt = NO_FILTER;
+        hud_data[i].extrap = NO_EXTRAP;
+        hud_data[i].stats = NO_STATS;
+        hud_data[i].stats_refs = 0;
     }
 
-    for (i = 0; i < OBD_PID_CNT; i++)
-        pid_ref_cnt[i] = 0;
+    filters_used = 0;
+    extraps_used = 0;
+    stats_used = 0;
+    sched_cnt = 0;
+    no_pid_items = 0;
+    sched_valid = 0;
+    sched_changed = 0;
 
     last_pid = OBD_PID_CNT;
 
-    avg_samples = 0;
+    my_auto_dispatch = eeprom_read_byte(&auto_dispatch_eemem);
 
-    avg_econ_spd = 0;
-    avg_econ_rate = 0;
-
-    avg_econ_updated = false;
-
-    /*
-     * Try to read the EE memory
-     */
-    for (i = 0; i < cnt_of_array(avg_econ_ee_mem); i++) {
-        /*
-         * Read the signature
-         */
-        sig = eeprom_read_byte(&avg_econ_ee_mem[i].sig);
-
-        /*
-         * If the signature is valid, read the data
-         */
-        if (sig == AVG_ECON_VALID_SIG) {
-            avg_samples = eeprom_read_word(
-                    &avg_econ_ee_mem[i].avg_samples);
-            avg_econ_spd = eeprom_read_float(
-                    &avg_econ_ee_mem[i].avg_econ_spd);
-            avg_econ_rate = eeprom_read_float(
-                    &avg_econ_ee_mem[i].avg_econ_rate);
-            break;
-        }
-    }
-
-    timer_create(&avg_econ_timer, AVG_ECON_WRITE_INTVL, avg_econ_write_clbk,
-            NULL);
+    TRIP_init();
+    ROLLING_init();
+    FUEL_init();
+    PERF_init();
+    SHIFT_init();
+    FORMULA_init();
 
     if (eeprom_read_byte(&fuel_econ_always_on))
-        HUD_data_add(HUD_DATA_AVG_ECON);
+        watch(HUD_DATA_AVG_ECON, false);
+
+    if (SHIFT_get_rpm())
+        watch(HUD_DATA_SHIFT_LATENCY, true);
 }
 
 void
@@ -535,9 +1436,9 @@ HUD_set_fuel_econ_always_on(bool always_on)
 {
     if (always_on != eeprom_read_byte(&fuel_econ_always_on)) {
         if (always_on)
-            HUD_data_add(HUD_DATA_AVG_ECON);
+            watch(HUD_DATA_AVG_ECON, false);
         else
-            HUD_data_remove(HUD_DATA_AVG_ECON);
+            unwatch(HUD_DATA_AVG_ECON, false);
 
         eeprom_write_byte(&fuel_econ_always_on, always_on);
     }
@@ -549,10 +1450,84 @@ HUD_get_fuel_econ_always_on(void)
     return eeprom_read_byte(&fuel_econ_always_on);
 }
 
+/*
+ * Sets the RPM at which the shift light comes on, or 0 to disable it. While it
+ * is enabled RPM is polled as if it were shown, since the shift light shows it
+ */
+void
+HUD_set_shift_rpm(uint16_t rpm)
+{
+    uint16_t old = SHIFT_get_rpm();
+
+    SHIFT_set_rpm(rpm);
+
+    if (rpm && !old)
+        watch(HUD_DATA_SHIFT_LATENCY, true);
+    else if (!rpm && old)
+        unwatch(HUD_DATA_SHIFT_LATENCY, true);
+}
+
+uint16_t
+HUD_get_shift_rpm(void)
+{
+    return SHIFT_get_rpm();
+}
+
+/*
+ * When enabled, the next PID request is staged while the current one is in
+ * progress so that it is sent as soon as the ELM is ready for it
+ */
+void
+HUD_set_auto_dispatch(bool auto_dispatch)
+{
+    my_auto_dispatch = auto_dispatch;
+    eeprom_update_byte(&auto_dispatch_eemem, auto_dispatch);
+}
+
+bool
+HUD_get_auto_dispatch(void)
+{
+    return my_auto_dispatch;
+}
+
+/*
+ * Returns the statistics slot for a statistics variant of a data item, or
+ * NO_STATS if it has no valid statistics
+ */
+static uint8_t
+var_stats(hud_data_t8 d)
+{
+    uint8_t s = hud_data[HUD_data_item(d)].stats;
+
+    if (s == NO_STATS || !stats[s].valid)
+        return NO_STATS;
+
+    return s;
+}
+
 bool
 HUD_data_get(hud_data_t8 d, char value[HUD_DATA_LEN])
 {
-    if (hud_data[d].watched && hud_data[d].valid) {
+    hud_var_t8 var = HUD_data_var(d);
+    uint8_t s;
+    int32_t v;
+
+    d = HUD_data_item(d);
+
+    if (var != HUD_VAR_CUR) {
+        if (hud_data[d].watched && (s = var_stats(d)) != NO_STATS) {
+            if (var == HUD_VAR_MIN)
+                v = stats[s].min;
+            else if (var == HUD_VAR_MAX)
+                v = stats[s].max;
+            else
+                v = stats[s].peak;
+
+            FMT_fixed(value, HUD_DATA_LEN, v, stats[s].prec, 0, 0);
+            stats[s].updated &= ~_BV(var);
+            return true;
+        }
+    } else if (hud_data[d].watched && hud_data[d].valid) {
         memcpy(value, hud_data[d].value, HUD_DATA_LEN);
         hud_data[d].updated = false;
         return true;
@@ -565,46 +1540,530 @@ HUD_data_get(hud_data_t8 d, char value[HUD_DATA_LEN])
 char const *
 HUD_data_name(hud_data_t8 d)
 {
-    return data_def[d].name;
+    return data_def[HUD_data_item(d)].name;
+}
+
+char const *
+HUD_var_name(hud_var_t8 v)
+{
+    return var_names[v];
 }
 
 bool
 HUD_data_valid(hud_data_t8 d)
 {
+    if (HUD_data_var(d) != HUD_VAR_CUR)
+        return var_stats(d) != NO_STATS;
+
     return hud_data[d].valid;
 }
 
-void
-HUD_process(void)
+/*
+ * Returns true if the current value of a data item is based on a PID value
+ * that has gone stale (e.g. because the link is too busy or the PID stopped
+ * answering). Statistics and invalid items are never stale
+ */
+bool
+HUD_data_stale(hud_data_t8 d)
 {
-    obd_pid_t8 i;
-    obd_pid_t8 next_pid;
+    uint8_t i;
+    uint16_t deps;
 
-    ELM327_process(false);
+    if (HUD_data_var(d) != HUD_VAR_CUR || !hud_data[d].valid)
+        return false;
 
-    if (ELM327_is_ready()) {
-        for (i = 0; i < HUD_DATA_CNT; i++)
-            check_data(i, last_pid);
-
-        for (i = 0; i < OBD_PID_CNT; i++) {
-            next_pid = (last_pid + i + 1) % OBD_PID_CNT;
-            if (pid_ref_cnt[next_pid]) {
-                ELM327_rqst_crnt_pid(next_pid);
-                break;
+    deps = hud_data[d].deps & ~SCHED_UNAVAIL;
+
+    for (i = 0; deps; i++, deps >>= 1) {
+        if ((deps & 1) && is_stale(i))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Returns true if a data item can't be shown because there was no room in the
+ * schedule for one of its PIDs
+ */
+bool
+HUD_data_unavail(hud_data_t8 d)
+{
+    if (HUD_data_var(d) != HUD_VAR_CUR)
+        return false;
+
+    return hud_data[d].deps & SCHED_UNAVAIL;
+}
+
+/*
+ * Gets the current poll interval of a schedule slot. Speed is polled as fast
+ * as possible while a performance run is armed, since the accuracy of the run
+ * depends on the sample interval
+ */
+static uint16_t
+slot_intvl(struct sched_type const *s)
+{
+    if (s->pid == OBD_PID_SPEED && PERF_is_armed())
+        return 0;
+
+    return s->intvl;
+}
+
+/*
+ * Picks the next PIDs to request: the one with the earliest deadline, moved
+ * PRIO_SLACK earlier for each level of priority. The scheduler is work
+ * conserving, so if nothing is late the PID that will be due first is
+ * requested anyway. If the stalest PID has gone stale and is late it is
+ * requested first.
+ *
+ * The rest of the PID's group is requested with it if the protocol allows
+ * several PIDs in one request, otherwise they are requested back to back
+ * before anything else. Returns the number of PIDs to request
+ */
+static uint8_t
+sched_next(obd_pid_t8 pids[ELM327_MAX_PIDS])
+{
+    uint8_t i;
+    uint8_t cnt;
+    int32_t diff;
+    uint16_t group;
+    struct sched_type *next = NULL;
+
+    if (group_pending) {
+        for (i = 0; !(group_pending & ((uint16_t)1 << i)); i++)
+            ;
+
+        group_pending &= ~((uint16_t)1 << i);
+        pids[0] = sched[i].pid;
+        return 1;
+    }
+
+    if (sched_cnt) {
+        i = stale_heap[0];
+
+        if (is_stale(i) && (int32_t)(timer_get() - sched[i].deadline) >= 0 &&
+                OBD_is_due(sched[i].pid))
+            next = &sched[i];
+    }
+
+    if (next == NULL) {
+        for (i = 0; i < sched_cnt; i++) {
+            if (!OBD_is_due(sched[i].pid))
+                continue;
+
+            if (next != NULL) {
+                diff = sched[i].deadline - next->deadline;
+                diff -= ((int16_t)sched[i].prio - next->prio) * PRIO_SLACK;
+
+                if (diff > 0 || (diff == 0 && sched[i].prio <= next->prio))
+                    continue;
+            }
+
+            next = &sched[i];
+        }
+    }
+
+    if (next == NULL)
+        return 0;
+
+    pids[0] = next->pid;
+    cnt = 1;
+
+    group = next->group & ~((uint16_t)1 << (next - sched));
+    group_fresh &= ~next->group;
+
+    for (i = 0; group; i++, group >>= 1) {
+        if (!(group & 1))
+            continue;
+
+        sched[i].deadline = timer_get() + slot_intvl(&sched[i]);
+
+        if (cnt < ELM327_MAX_PIDS && ELM327_multi_pid())
+            pids[cnt++] = sched[i].pid;
+        else
+            group_pending |= (uint16_t)1 << i;
+    }
+
+    next->deadline = timer_get() + slot_intvl(next);
+    return cnt;
+}
+
+/*
+ * The scheduler state that sched_next() changes, so a pick can be undone if
+ * its request can't be sent
+ */
+struct sched_save_type {
+    uint16_t group_pending;
+    uint16_t group_fresh;
+    uint32_t deadline[MAX_SCHED_PIDS];
+};
+
+static void
+sched_save(struct sched_save_type *save)
+{
+    uint8_t i;
+
+    save->group_pending = group_pending;
+    save->group_fresh = group_fresh;
+
+    for (i = 0; i < sched_cnt; i++)
+        save->deadline[i] = sched[i].deadline;
+}
+
+static void
+sched_restore(struct sched_save_type const *save)
+{
+    uint8_t i;
+
+    group_pending = save->group_pending;
+    group_fresh = save->group_fresh;
+
+    for (i = 0; i < sched_cnt; i++)
+        sched[i].deadline = save->deadline[i];
+}
+
+/*
+ * Updates the average rate of change of a slot's PID, in raw units per second,
+ * from a new sample. Returns true if the sample moved more than twice as fast
+ * as the average
+ */
+static bool
+track_rate(struct sched_type *s, bool had_value)
+{
+    int32_t value;
+    uint16_t time;
+    uint16_t dt;
+    uint32_t delta;
+    uint16_t rate;
+    bool surge;
+
+    value = OBD_get_value(s->pid);
+    time = OBD_get_time(s->pid);
+    dt = time - s->last_time;
+    surge = false;
+
+    if (had_value && dt != 0) {
+        delta = value > s->last_value ? value - s->last_value :
+            s->last_value - value;
+        rate = minval(minval(delta, UINT32_MAX / 1000) * 1000 / dt,
+                UINT16_MAX);
+
+        surge = rate > ((uint32_t)s->rate << 1);
+
+        s->rate -= s->rate >> CHG_RATE_SHIFT;
+        s->rate += rate >> CHG_RATE_SHIFT;
+    }
+
+    s->last_value = value;
+    s->last_time = time;
+
+    return surge;
+}
+
+/*
+ * Adapts the poll interval of a PID based on whether its latest value changed
+ * anything on the display, or moved faster than it has been. Signals that are moving are polled faster, and ones
+ * that have settled are polled slower, within the bounds of the items that
+ * use them
+ */
+static void
+sched_adapt(struct sched_type *s, bool changed, bool surge)
+{
+    s->chg_rate -= s->chg_rate >> CHG_RATE_SHIFT;
+    if (changed)
+        s->chg_rate += UINT8_MAX >> CHG_RATE_SHIFT;
+
+    if (s->chg_rate > CHG_RATE_HI || surge)
+        s->intvl = maxval(s->intvl - (s->intvl >> 2), s->intvl_min);
+    else if (s->chg_rate < CHG_RATE_LO)
+        s->intvl = minval((uint32_t)s->intvl + (s->intvl >> 2),
+                s->intvl_max);
+}
+
+/*
+ * Passes a new PID value to the modules that integrate it over time
+ */
+static void
+record_sample(obd_pid_t8 pid)
+{
+    uint32_t time = OBD_get_time(pid);
+
+    if (pid == OBD_PID_SPEED) {
+        TRIP_add_speed(OBD_get_speed(), time);
+        PERF_add_speed(OBD_get_speed(), time);
+    } else if (pid == OBD_PID_MAF_RATE) {
+        TRIP_add_MAF_rate(OBD_get_MAF_rate(), time);
+    } else if (pid == OBD_PID_ENGN_LOAD) {
+        ROLLING_add_load(OBD_get_engn_load(), time);
+    } else if (pid == OBD_PID_FUEL_LVL_INPUT) {
+        FUEL_add_level(OBD_get_fuel_lvl(), time);
+    }
+}
+
+/*
+ * Updates the data items that depend on the PID of a schedule slot that just
+ * received a response. Items that depend on several PIDs are only calculated
+ * when their first PID arrives, since otherwise the calculation would be run
+ * multiple times and each time only one data value could possibly change.
+ * Grouped items are instead calculated when the last PID of their group
+ * arrives, so they use values sampled together.
+ *
+ * A display change is credited to every PID the item depends on, not only the
+ * one whose arrival calculated it. Each slot takes its credit when its next
+ * sample is adapted
+ */
+static void
+process_slot(uint8_t i)
+{
+    uint16_t bit;
+    hud_data_t8 d;
+    obd_pid_t8 pid;
+    obd_pid_t8 const *pids;
+    bool surge;
+    uint64_t items;
+
+    pid = sched[i].pid;
+    bit = (uint16_t)1 << i;
+    surge = false;
+
+    if (OBD_is_valid(pid)) {
+        surge = track_rate(&sched[i], sched_valid & bit);
+        sched_valid |= bit;
+        group_fresh |= bit;
+        set_stale_time(i, OBD_get_time(pid));
+        record_sample(pid);
+    } else {
+        sched_valid &= ~bit;
+    }
+
+    for (d = 0, items = sched[i].items; items; d++, items >>= 1) {
+        if (!(items & 1))
+            continue;
+
+        if (hud_data[d].deps & ~sched_valid) {
+            hud_data[d].valid = false;
+        } else if (data_def[d].flags & DEF_GROUP) {
+            if (!(hud_data[d].deps & ~group_fresh)) {
+                group_fresh &= ~hud_data[d].deps;
+                if (calc_data(d))
+                    sched_changed |= hud_data[d].deps;
             }
+        } else if (item_pids(d, &pids) && pids[0] == pid) {
+            if (calc_data(d))
+                sched_changed |= hud_data[d].deps;
         }
+    }
+
+    sched_adapt(&sched[i], sched_changed & bit, surge);
+    sched_changed &= ~bit;
+}
 
-        if (i != OBD_PID_CNT)
-            last_pid = next_pid;
+/*
+ * Processes a completed request. A multi-PID request completes as its first
+ * PID; the rest of its group that arrived in the same response have the same
+ * timestamp, and haven't been processed yet
+ */
+static void
+process_pid(obd_pid_t8 pid)
+{
+    uint8_t i;
+    uint8_t j;
+    uint16_t group;
+    uint32_t time;
+
+    for (i = 0; i < sched_cnt && sched[i].pid != pid; i++)
+        ;
+
+    if (i == sched_cnt)
+        return;
+
+    process_slot(i);
+
+    if (!OBD_is_valid(pid))
+        return;
+
+    time = OBD_get_time(pid);
+    group = sched[i].group & ~((uint16_t)1 << i);
+
+    for (j = 0; group; j++, group >>= 1) {
+        if ((group & 1) && OBD_is_valid(sched[j].pid) &&
+                OBD_get_time(sched[j].pid) == time &&
+                sched[j].stale_time != stale_at(j, time))
+            process_slot(j);
+    }
+}
+
+/*
+ * Records a completed request while bursting. Responses to requests made
+ * before the burst started are ignored, as are completions that brought no
+ * new value (e.g. the ELM answered "?"), which leave the timestamp unchanged
+ */
+static void
+burst_sample(obd_pid_t8 pid)
+{
+    int32_t value;
+    uint32_t time;
+
+    if (pid != burst.pid || !OBD_is_valid(pid))
+        return;
+
+    time = OBD_get_time(pid);
+    if ((int32_t)(time - burst.last) <= 0)
+        return;
+
+    value = OBD_get_value(pid);
+    burst.last = time;
+
+    burst.head = (burst.head + 1) % BURST_RING_CNT;
+    burst.ring[burst.head].time = burst.last - burst.start;
+    burst.ring[burst.head].value = value;
+
+    if (!burst.cnt || value > burst.max)
+        burst.max = value;
+
+    if (burst.cnt < UINT16_MAX) {
+        burst.sum += value;
+        burst.cnt++;
+    }
+
+    record_sample(pid);
+}
+
+/*
+ * Requests the burst PID again. The ELM is told to repeat its last command if
+ * that was the burst request; otherwise (at the start of the burst, or after
+ * the link was reconfigured) the request is sent in full
+ */
+static void
+burst_rqst(void)
+{
+    if (ELM327_is_ready()) {
+        if (ELM327_can_repeat(burst.pid))
+            ELM327_rqst_repeat();
         else
-            last_pid = OBD_PID_CNT;
+            ELM327_rqst_crnt_pid(burst.pid);
+    } else if (my_auto_dispatch && ELM327_can_stage()) {
+        if (ELM327_can_repeat(burst.pid))
+            ELM327_stage_repeat();
+        else
+            ELM327_stage_crnt_pid(burst.pid);
     }
 }
 
+/*
+ * Starts polling a single PID as fast as the link allows. All other data items
+ * stop updating until the burst is stopped
+ */
+void
+HUD_burst_start(obd_pid_t8 pid)
+{
+    burst.pid = pid;
+    burst.start = timer_get();
+    burst.last = burst.start;
+    burst.cnt = 0;
+    burst.head = 0;
+    burst.max = 0;
+    burst.sum = 0;
+}
+
+/*
+ * Stops the burst and summarizes it. The rate is in 0.1 Hz
+ */
+void
+HUD_burst_stop(struct hud_burst_summary *summary)
+{
+    uint32_t elapsed = burst.last - burst.start;
+
+    summary->cnt = burst.cnt;
+    summary->max = burst.max;
+    summary->avg = burst.cnt ? burst.sum / burst.cnt : 0;
+    summary->rate = elapsed ? (uint32_t)burst.cnt * 10000 / elapsed : 0;
+
+    burst.pid = OBD_PID_CNT;
+}
+
+/*
+ * Gets a sample of the current burst, with 0 being the most recent. Returns
+ * false if there is no such sample
+ */
+bool
+HUD_burst_get(uint8_t i, uint16_t *time, int32_t *value)
+{
+    uint8_t s;
+
+    if (i >= minval(burst.cnt, BURST_RING_CNT))
+        return false;
+
+    s = (burst.head + BURST_RING_CNT - i) % BURST_RING_CNT;
+    *time = burst.ring[s].time;
+    *value = burst.ring[s].value;
+    return true;
+}
+
+void
+HUD_process(void)
+{
+    obd_pid_t8 pid;
+    obd_pid_t8 pids[ELM327_MAX_PIDS];
+    uint8_t cnt;
+    struct sched_save_type save;
+
+    ELM327_process(false);
+    TRIP_process();
+    ROLLING_process();
+
+    pid = ELM327_get_cmplt_pid();
+
+    if (burst.pid != OBD_PID_CNT) {
+        if (pid != OBD_PID_CNT) {
+            last_pid = pid;
+            burst_sample(pid);
+        }
+
+        burst_rqst();
+        return;
+    }
+
+    if (pid != OBD_PID_CNT) {
+        last_pid = pid;
+        process_pid(pid);
+    }
+
+    if (pid != OBD_PID_CNT || ELM327_is_ready())
+        calc_no_pid_items();
+
+    extrapolate_items();
+
+    if (ELM327_is_ready()) {
+        cnt = sched_next(pids);
+
+        if (cnt)
+            ELM327_rqst_crnt_pids(pids, cnt);
+    } else if (my_auto_dispatch && ELM327_can_stage()) {
+        sched_save(&save);
+        cnt = sched_next(pids);
+
+        /*
+         * If the request couldn't be staged, the PIDs are picked again next
+         * time instead of waiting for their next deadline
+         */
+        if (cnt && !ELM327_stage_crnt_pids(pids, cnt))
+            sched_restore(&save);
+    }
+}
 
 bool
 HUD_data_updated(hud_data_t8 d)
 {
+    hud_var_t8 var = HUD_data_var(d);
+    uint8_t s;
+
+    d = HUD_data_item(d);
+
+    if (var != HUD_VAR_CUR)
+        return hud_data[d].watched && (s = var_stats(d)) != NO_STATS &&
+            (stats[s].updated & _BV(var));
+
     return hud_data[d].watched && hud_data[d].valid && hud_data[d].updated;
 }
 
@@ -23,6 +23,9 @@
 #define _HUD_DATA_H_
 
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "obd_pid.h"
 
 #define HUD_DATA_LEN (6)
 
@@ -47,10 +50,53 @@ typedef uint8_t hud_data_t8; enum {
     HUD_DATA_COOLANT_TEMP_F,
     HUD_DATA_OIL_TEMP_C,
     HUD_DATA_OIL_TEMP_F,
+    HUD_DATA_ELM_IDLE,
+    HUD_DATA_TRIP_DIST,
+    HUD_DATA_TRIP_FUEL,
+    HUD_DATA_TRIP_TIME,
+    HUD_DATA_USER_1,
+    HUD_DATA_USER_2,
+    HUD_DATA_USER_3,
+    HUD_DATA_USER_4,
+    HUD_DATA_ECON_1_MIN,
+    HUD_DATA_ECON_5_MIN,
+    HUD_DATA_ECON_15_MIN,
+    HUD_DATA_SPEED_1_MIN,
+    HUD_DATA_SPEED_5_MIN,
+    HUD_DATA_SPEED_15_MIN,
+    HUD_DATA_LOAD_1_MIN,
+    HUD_DATA_LOAD_5_MIN,
+    HUD_DATA_LOAD_15_MIN,
+    HUD_DATA_RANGE,
+    HUD_DATA_PERF_60_MPH,
+    HUD_DATA_PERF_100_KPH,
+    HUD_DATA_PERF_QTR_MILE,
+    HUD_DATA_PERF_INTVL,
+    HUD_DATA_SHIFT_LATENCY,
 
     HUD_DATA_CNT
 };
 
+/*
+ * A data item can be shown as its current value or as one of its statistics.
+ * The variant is encoded in the upper bits of a hud_data_t8
+ */
+typedef uint8_t hud_var_t8; enum {
+    HUD_VAR_CUR,
+    HUD_VAR_MIN,
+    HUD_VAR_MAX,
+    HUD_VAR_PEAK,
+
+    HUD_VAR_CNT
+};
+
+#define HUD_DATA_VAR_SHIFT (6)
+#define HUD_DATA_ITEM_MASK ((1 << HUD_DATA_VAR_SHIFT) - 1)
+
+#define HUD_data_item(_d) ((_d) & HUD_DATA_ITEM_MASK)
+#define HUD_data_var(_d) ((_d) >> HUD_DATA_VAR_SHIFT)
+#define HUD_data_make(_d, _v) ((_d) | ((_v) << HUD_DATA_VAR_SHIFT))
+
 void
 HUD_data_add(hud_data_t8 d);
 
@@ -66,6 +112,18 @@ HUD_set_fuel_econ_always_on(bool always_on);
 bool
 HUD_get_fuel_econ_always_on(void);
 
+void
+HUD_set_auto_dispatch(bool auto_dispatch);
+
+bool
+HUD_get_auto_dispatch(void);
+
+void
+HUD_set_shift_rpm(uint16_t rpm);
+
+uint16_t
+HUD_get_shift_rpm(void);
+
 bool
 HUD_data_get(hud_data_t8, char value[HUD_DATA_LEN]);
 
@@ -78,7 +136,38 @@ HUD_process(void);
 bool
 HUD_data_updated(hud_data_t8 d);
 
+bool
+HUD_data_stale(hud_data_t8 d);
+
+bool
+HUD_data_unavail(hud_data_t8 d);
+
 char const *
 HUD_data_name(hud_data_t8 d);
 
+char const *
+HUD_var_name(hud_var_t8 v);
+
+void
+HUD_stats_reset(void);
+
+/*
+ * Summary of a burst. rate is the achieved sample rate in 0.1 Hz
+ */
+struct hud_burst_summary {
+    uint16_t cnt;
+    int32_t max;
+    int32_t avg;
+    uint16_t rate;
+};
+
+void
+HUD_burst_start(obd_pid_t8 pid);
+
+void
+HUD_burst_stop(struct hud_burst_summary *summary);
+
+bool
+HUD_burst_get(uint8_t i, uint16_t *time, int32_t *value);
+
 #endif /* _HUD_DATA_H_ */
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2017 Joshua Watt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <avr/eeprom.h>
+#include <string.h>
+#include <util/crc16.h>
+
+#include "journal.h"
+#include "utl.h"
+
+/*
+ * A journal is a circular buffer of records in EEPROM. Each save goes to the
+ * slot after the newest record, so writes are spread evenly across the whole
+ * region instead of wearing out the same cells. Every record carries a
+ * sequence number and a CRC, so a record that was torn by a power loss is
+ * simply ignored and the previous one is used instead.
+ *
+ * Records are written one byte at a time from JOURNAL_process() whenever the
+ * EEPROM is ready, so saving never stalls the main loop
+ */
+
+static uint16_t
+calc_crc(uint8_t const *buf, uint8_t len)
+{
+    uint16_t crc = 0xFFFF;
+
+    while (len--)
+        crc = _crc16_update(crc, *buf++);
+
+    return crc;
+}
+
+static uint8_t *
+rec_addr(struct journal const *j, uint8_t idx)
+{
+    return j->ee + (uint16_t)idx * JOURNAL_REC_SZ(j->data_sz);
+}
+
+/*
+ * Scans the journal for the newest valid record and loads its payload into
+ * data. Returns false (leaving data untouched) if there are no valid records
+ */
+bool
+JOURNAL_init(struct journal *j, void *ee, uint8_t data_sz, uint8_t rec_cnt,
+        void *data)
+{
+    uint8_t i;
+    uint8_t rec_sz;
+    uint16_t seq;
+    uint16_t crc;
+    bool found = false;
+
+    j->ee = ee;
+    j->data_sz = minval(data_sz, JOURNAL_MAX_DATA);
+    j->rec_cnt = rec_cnt;
+    j->head = rec_cnt - 1;
+    j->seq = 0;
+    j->pos = 0;
+    j->len = 0;
+
+    rec_sz = JOURNAL_REC_SZ(j->data_sz);
+
+    for (i = 0; i < rec_cnt; i++) {
+        eeprom_read_block(j->rec, rec_addr(j, i), rec_sz);
+
+        memcpy(&crc, &j->rec[rec_sz - sizeof(crc)], sizeof(crc));
+        if (crc != calc_crc(j->rec, rec_sz - sizeof(crc)))
+            continue;
+
+        memcpy(&seq, j->rec, sizeof(seq));
+
+        /*
+         * Sequence numbers wrap, so compare them as a signed difference
+         */
+        if (!found || (int16_t)(seq - j->seq) > 0) {
+            found = true;
+            j->seq = seq;
+            j->head = i;
+            memcpy(data, &j->rec[sizeof(seq)], j->data_sz);
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Starts writing a new record with a copy of data. Returns false if the
+ * previous record is still being written
+ */
+bool
+JOURNAL_write(struct journal *j, void const *data)
+{
+    uint8_t rec_sz;
+    uint16_t crc;
+
+    if (JOURNAL_busy(j))
+        return false;
+
+    rec_sz = JOURNAL_REC_SZ(j->data_sz);
+
+    j->seq++;
+    j->head = (j->head + 1) % j->rec_cnt;
+
+    memcpy(j->rec, &j->seq, sizeof(j->seq));
+    memcpy(&j->rec[sizeof(j->seq)], data, j->data_sz);
+
+    crc = calc_crc(j->rec, rec_sz - sizeof(crc));
+    memcpy(&j->rec[rec_sz - sizeof(crc)], &crc, sizeof(crc));
+
+    j->pos = 0;
+    j->len = rec_sz;
+
+    JOURNAL_process(j);
+
+    return true;
+}
+
+/*
+ * Writes the next byte of a pending record if the EEPROM is idle
+ */
+void
+JOURNAL_process(struct journal *j)
+{
+    if (JOURNAL_busy(j) && eeprom_is_ready()) {
+        eeprom_update_byte(rec_addr(j, j->head) + j->pos, j->rec[j->pos]);
+        j->pos++;
+    }
+}
+
+bool
+JOURNAL_busy(struct journal const *j)
+{
+    return j->pos < j->len;
+}
+
+/*
+ * Blocks until any pending record has been completely written
+ */
+void
+JOURNAL_flush(struct journal *j)
+{
+    while (JOURNAL_busy(j))
+        JOURNAL_process(j);
+}
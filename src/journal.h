@@ -0,0 +1,67 @@
+/*
+ * Copyright 2017 Joshua Watt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Largest payload that can be stored in a journal record
+ */
+#define JOURNAL_MAX_DATA (16)
+
+/*
+ * Size of a record in EEPROM for a given payload size: a 16 bit sequence
+ * number, the payload, and a 16 bit CRC
+ */
+#define JOURNAL_REC_SZ(_data_sz) \
+    (sizeof(uint16_t) + (_data_sz) + sizeof(uint16_t))
+
+struct journal {
+    uint8_t *ee;
+    uint8_t data_sz;
+    uint8_t rec_cnt;
+    uint8_t head;
+    uint16_t seq;
+    uint8_t pos;
+    uint8_t len;
+    uint8_t rec[JOURNAL_REC_SZ(JOURNAL_MAX_DATA)];
+};
+
+bool
+JOURNAL_init(struct journal *j, void *ee, uint8_t data_sz, uint8_t rec_cnt,
+        void *data);
+
+bool
+JOURNAL_write(struct journal *j, void const *data);
+
+void
+JOURNAL_process(struct journal *j);
+
+bool
+JOURNAL_busy(struct journal const *j);
+
+void
+JOURNAL_flush(struct journal *j);
+
+#endif /* _JOURNAL_H_ */
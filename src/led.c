@@ -66,6 +66,13 @@ blink_led_timer(void *param)
     off(led);
 }
 
+static void
+delay_led_timer(void *param)
+{
+    struct led *led = param;
+    on(led);
+}
+
 static void
 strobe_led_timer(void *param)
 {
@@ -135,6 +142,16 @@ LED_blink(enum LED l, uint16_t duration)
     timer_create(&led->timer, duration, blink_led_timer, led);
 }
 
+/*
+ * Turns an LED on after a delay in milliseconds
+ */
+void
+LED_delay_on(enum LED l, uint16_t delay)
+{
+    struct led *led = get(l);
+    timer_create(&led->timer, delay, delay_led_timer, led);
+}
+
 void
 LED_strobe(enum LED l, uint16_t rate)
 {
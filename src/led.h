@@ -54,6 +54,9 @@ LED_toggle(enum LED l);
 void
 LED_blink(enum LED l, uint16_t time);
 
+void
+LED_delay_on(enum LED l, uint16_t delay);
+
 void
 LED_strobe(enum LED l, uint16_t rate);
 
@@ -31,12 +31,16 @@
 #include "btn.h"
 #include "diagnostics.h"
 #include "elm327.h"
+#include "fuel.h"
 #include "hud_data.h"
 #include "layout.h"
 #include "led.h"
 #include "menu.h"
 #include "obd_data.h"
+#include "perf.h"
+#include "shift.h"
 #include "timer.h"
+#include "trip.h"
 #include "uart.h"
 #include "utl.h"
 #include "vfd.h"
@@ -58,6 +62,28 @@
 
 #define MAX_IDLE_TIME (10000)
 
+/*
+ * Tank sizes are offered from TANK_SIZE_MIN gallons in steps of
+ * TANK_SIZE_STEP
+ */
+#define TANK_SIZE_MIN (8)
+#define TANK_SIZE_STEP (2)
+#define TANK_SIZE_CNT (12)
+
+/*
+ * Speed corrections are offered in whole percentages from SPEED_SCALE_MIN
+ */
+#define SPEED_SCALE_MIN (-10)
+#define SPEED_SCALE_CNT (21)
+
+/*
+ * Shift light thresholds are offered from SHIFT_RPM_MIN in steps of
+ * SHIFT_RPM_STEP, after an entry to turn it off
+ */
+#define SHIFT_RPM_MIN (3000)
+#define SHIFT_RPM_STEP (500)
+#define SHIFT_RPM_CNT (10)
+
 #ifndef NO_VFD
     #define display_ready() VFD_ready()
 #else
@@ -74,7 +100,7 @@ enum layout_idx {
 
 struct watch_state_type {
     bool updated;
-    bool valid;
+    bool stale;
     char text_buffer[ HUD_DATA_LEN ];
 };
 
@@ -118,14 +144,24 @@ static uint8_t EEMEM brightness_eemem = VFD_BRIGHT_DEFAULT;
 
 static struct data_page_type watch_pages[MAX_PAGES];
 
+/*
+ * Connection indicator for each ELM327 link state
+ */
+static const char *const link_state_str[] = {
+    [ELM327_LINK_UP]        = " ",
+    [ELM327_LINK_RETRY]     = "?",
+    [ELM327_LINK_BACKOFF]   = "X",
+};
+
 static const char splash_str[] = "Hello Joshua";
 static const char invalid_data_str[] = "---";
+static const char unavail_data_str[] = "Full";
 
 static struct data_page_type const *my_cur_page = NULL;
 static uint8_t my_cur_page_idx = 0;
 static uint8_t my_num_pages;
 static bool my_searching = false;
-static bool my_connected = true;
+static ELM327_link_state_type my_link_state = ELM327_LINK_UP;
 static uint8_t my_last_updt = 0;
 static struct watch_state_type my_state[DATA_CNT];
 
@@ -179,6 +215,52 @@ clear_dtc_menu(enum menu_id id, void *param)
     return (m == MENU_TIMEOUT) ? m : MENU_NONE;
 }
 
+static enum menu_id
+reset_trip_menu(enum menu_id id, void *param)
+{
+    enum menu_id m;
+
+    VFD_soft_reset();
+    m = menu_yes_no("Reset trip?");
+
+    if (m == MENU_YES)
+        TRIP_reset();
+
+    return (m == MENU_TIMEOUT) ? m : MENU_NONE;
+}
+
+static enum menu_id
+reset_stats_menu(enum menu_id id, void *param)
+{
+    enum menu_id m;
+
+    VFD_soft_reset();
+    m = menu_yes_no("Reset stats?");
+
+    if (m == MENU_YES)
+        HUD_stats_reset();
+
+    return (m == MENU_TIMEOUT) ? m : MENU_NONE;
+}
+
+/*
+ * Arms a performance run. The run starts when the car pulls away from a stop,
+ * and its times are shown by the performance data items
+ */
+static enum menu_id
+perf_timer_menu(enum menu_id id, void *param)
+{
+    enum menu_id m;
+
+    VFD_soft_reset();
+    m = menu_yes_no("Arm perf timer?");
+
+    if (m == MENU_YES)
+        PERF_arm();
+
+    return (m == MENU_TIMEOUT) ? m : MENU_NONE;
+}
+
 static enum menu_id
 view_dtc_menu(enum menu_id id, void *param)
 {
@@ -192,9 +274,12 @@ choose_data_items(struct data_page_type *dp)
 {
     struct menu_type data_menu_items[DATA_CNT];
     struct menu_type hud_menu[HUD_DATA_CNT];
+    struct menu_type var_menu[HUD_VAR_CNT];
+    char names[DATA_CNT][20];
     enum menu_id m;
     int i;
     uint8_t data_idx;
+    hud_data_t8 item;
 
     // Construct HUD menu
     for (i = 0; i < HUD_DATA_CNT; i++) {
@@ -203,16 +288,31 @@ choose_data_items(struct data_page_type *dp)
         hud_menu[i].proc = NULL;
     }
 
+    for (i = 0; i < HUD_VAR_CNT; i++) {
+        var_menu[i].id = i;
+        var_menu[i].string = HUD_var_name(i);
+        var_menu[i].proc = NULL;
+    }
+
     for (i = 0; i < DATA_CNT; i++) {
-        if (dp->data[i] >= HUD_DATA_CNT)
+        if (HUD_data_item(dp->data[i]) >= HUD_DATA_CNT ||
+                HUD_data_var(dp->data[i]) >= HUD_VAR_CNT)
             dp->data[i] = HUD_DATA_NONE;
     }
 
     while (true) {
         for (i = 0; i < layouts[dp->layout]->wndw_cnt; i++) {
             data_menu_items[i].id = i;
-            data_menu_items[i].string = HUD_data_name(dp->data[i]);
             data_menu_items[i].proc = NULL;
+
+            if (HUD_data_var(dp->data[i]) == HUD_VAR_CUR) {
+                data_menu_items[i].string = HUD_data_name(dp->data[i]);
+            } else {
+                snprintf(names[i], sizeof(names[i]), "%s %s",
+                        HUD_var_name(HUD_data_var(dp->data[i])),
+                        HUD_data_name(dp->data[i]));
+                data_menu_items[i].string = names[i];
+            }
         }
 
         m = menu_process(layouts[dp->layout], data_menu_items,
@@ -225,13 +325,30 @@ choose_data_items(struct data_page_type *dp)
             data_idx = m;
 
             m = menu_process(&layout_4, hud_menu, cnt_of_array(hud_menu),
-                    dp->data[data_idx], NULL);
+                    HUD_data_item(dp->data[data_idx]), NULL);
+
+            if (m == MENU_TIMEOUT)
+                break;
+
+            if ((int)m >= HUD_DATA_CNT)
+                continue;
+
+            if ((int)m == HUD_DATA_NONE) {
+                dp->data[data_idx] = HUD_DATA_NONE;
+                continue;
+            }
+
+            item = m;
+
+            // Choose which value of the item to show
+            m = menu_process(&layout_4, var_menu, cnt_of_array(var_menu),
+                    HUD_data_var(dp->data[data_idx]), NULL);
 
             if (m == MENU_TIMEOUT)
                 break;
 
-            if ((int)m < HUD_DATA_CNT)
-                dp->data[data_idx] = m;
+            if ((int)m < HUD_VAR_CNT)
+                dp->data[data_idx] = HUD_data_make(item, m);
         }
     }
 }
@@ -381,11 +498,148 @@ fuel_econ_menu(enum menu_id id, void *param)
     return (m == MENU_TIMEOUT) ? m : MENU_NONE;
 }
 
+static enum menu_id
+auto_dispatch_menu(enum menu_id id, void *param)
+{
+    static const struct menu_type options[] = {
+        {   false,  "Off",  NULL    },
+        {   true,   "On",   NULL    },
+    };
+
+    enum menu_id m;
+
+    m = menu_process(&layout_2_TB, options, cnt_of_array(options),
+            HUD_get_auto_dispatch(), NULL);
+
+    if (m == true || m == false) {
+        HUD_set_auto_dispatch(!!m);
+    }
+
+    return (m == MENU_TIMEOUT) ? m : MENU_NONE;
+}
+
+static enum menu_id
+tank_size_menu(enum menu_id id, void *param)
+{
+    static struct menu_type menu[TANK_SIZE_CNT];
+    static char menu_names[TANK_SIZE_CNT][8];
+
+    uint8_t i;
+    enum menu_id m;
+
+    for (i = 0; i < TANK_SIZE_CNT; i++) {
+        menu[i].id = i;
+        menu[i].string = menu_names[i];
+        menu[i].proc = NULL;
+
+        sprintf(menu_names[i], "%u gal", TANK_SIZE_MIN + i * TANK_SIZE_STEP);
+    }
+
+    i = (maxval(FUEL_get_tank_size(), TANK_SIZE_MIN) - TANK_SIZE_MIN) /
+        TANK_SIZE_STEP;
+
+    m = menu_process(&layout_4, menu, cnt_of_array(menu),
+            minval(i, TANK_SIZE_CNT - 1), NULL);
+
+    if (m < TANK_SIZE_CNT)
+        FUEL_set_tank_size(TANK_SIZE_MIN + m * TANK_SIZE_STEP);
+
+    return (m == MENU_TIMEOUT) ? m : MENU_NONE;
+}
+
+static enum menu_id
+speed_cal_menu(enum menu_id id, void *param)
+{
+    static struct menu_type menu[SPEED_SCALE_CNT];
+    static char menu_names[SPEED_SCALE_CNT][6];
+
+    int8_t pct;
+    uint8_t i;
+    enum menu_id m;
+
+    for (i = 0; i < SPEED_SCALE_CNT; i++) {
+        menu[i].id = i;
+        menu[i].string = menu_names[i];
+        menu[i].proc = NULL;
+
+        sprintf(menu_names[i], "%+d%%", SPEED_SCALE_MIN + i);
+    }
+
+    pct = minval(maxval(OBD_get_speed_scale(), SPEED_SCALE_MIN),
+            SPEED_SCALE_MIN + SPEED_SCALE_CNT - 1);
+
+    m = menu_process(&layout_4, menu, cnt_of_array(menu),
+            pct - SPEED_SCALE_MIN, NULL);
+
+    if (m < SPEED_SCALE_CNT)
+        OBD_set_speed_scale(SPEED_SCALE_MIN + m);
+
+    return (m == MENU_TIMEOUT) ? m : MENU_NONE;
+}
+
+/*
+ * The status LED strobes while connected, unless it is used as the shift light
+ */
+static void
+set_status_led(void)
+{
+    if (HUD_get_shift_rpm())
+        SHIFT_reset();
+    else
+        LED_strobe(LED_STATUS, 500);
+}
+
+static enum menu_id
+shift_light_menu(enum menu_id id, void *param)
+{
+    static struct menu_type menu[SHIFT_RPM_CNT + 1];
+    static char menu_names[SHIFT_RPM_CNT][10];
+
+    uint8_t i;
+    uint16_t rpm;
+    enum menu_id m;
+
+    menu[0].id = 0;
+    menu[0].string = "Off";
+    menu[0].proc = NULL;
+
+    for (i = 0; i < SHIFT_RPM_CNT; i++) {
+        menu[i + 1].id = i + 1;
+        menu[i + 1].string = menu_names[i];
+        menu[i + 1].proc = NULL;
+
+        sprintf(menu_names[i], "%u RPM", SHIFT_RPM_MIN + i * SHIFT_RPM_STEP);
+    }
+
+    rpm = HUD_get_shift_rpm();
+    i = 0;
+
+    if (rpm)
+        i = (maxval(rpm, SHIFT_RPM_MIN) - SHIFT_RPM_MIN) / SHIFT_RPM_STEP + 1;
+
+    m = menu_process(&layout_4, menu, cnt_of_array(menu),
+            minval(i, SHIFT_RPM_CNT), NULL);
+
+    if (m == 0) {
+        HUD_set_shift_rpm(0);
+        set_status_led();
+    } else if (m <= SHIFT_RPM_CNT) {
+        HUD_set_shift_rpm(SHIFT_RPM_MIN + (m - 1) * SHIFT_RPM_STEP);
+        set_status_led();
+    }
+
+    return (m == MENU_TIMEOUT) ? m : MENU_NONE;
+}
+
 static enum menu_id
 settings_menu(enum menu_id id, void *param)
 {
     static const struct menu_type menu[] = {
         {   MENU_NONE,  "Fuel Econ",    fuel_econ_menu      },
+        {   MENU_NONE,  "Auto Dispatch",auto_dispatch_menu  },
+        {   MENU_NONE,  "Tank Size",    tank_size_menu      },
+        {   MENU_NONE,  "Speed Cal",    speed_cal_menu      },
+        {   MENU_NONE,  "Shift Light",  shift_light_menu    },
         {   MENU_BACK,  "Back",         NULL                },
     };
 
@@ -403,6 +657,9 @@ static const struct menu_type main_menu[] = {
     {   MENU_NONE,  "Brightness",   brightness_menu         },
     {   MENU_NONE,  "View DTCs",    view_dtc_menu           },
     {   MENU_NONE,  "Clear DTCs",   clear_dtc_menu          },
+    {   MENU_NONE,  "Reset Trip",   reset_trip_menu         },
+    {   MENU_NONE,  "Reset Stats",  reset_stats_menu        },
+    {   MENU_NONE,  "Perf Timer",   perf_timer_menu         },
     {   MENU_NONE,  "Diagnostics",  diagnostics_menu        },
 
     {   MENU_BACK,  "Back",         NULL                    },
@@ -454,7 +711,7 @@ create_layout(struct data_page_type const *page)
              * Register for HUD Data
              */
             my_state[i].updated = true;
-            my_state[i].valid = true;
+            my_state[i].stale = false;
             strcpy(my_state[i].text_buffer, invalid_data_str);
             HUD_data_add(my_cur_page->data[i]);
         }
@@ -575,15 +832,16 @@ process_display(void)
         VFD_font_size(1, 1);
         VFD_set_cursor(SEARCH_X, SEARCH_Y);
         VFD_write_string(my_searching ? "S" : " ");
-    } else if (my_connected != ELM327_connected()) {
+    } else if (my_link_state != ELM327_get_link_state()) {
+        my_link_state = ELM327_get_link_state();
 #ifndef NO_VFD
         VFD_win_select(VFD_WIN_BASE);
-        my_connected = ELM327_connected();
         VFD_font_size(1, 1);
         VFD_set_cursor(CONN_X, CONN_Y);
-        VFD_write_string(my_connected ? " " : "X");
+        VFD_write_string(link_state_str[my_link_state]);
 #else
-        UART_printf(DISPLAY_UART, "Not Connected\n\r");
+        UART_printf(DISPLAY_UART, "Link '%s'\n\r",
+                link_state_str[my_link_state]);
 #endif
     } else {
         for (i = 1; i < layouts[my_cur_page->layout]->wndw_cnt; i++) {
@@ -599,7 +857,9 @@ process_display(void)
                     *------------------------------------------------------*/
                 VFD_font_size(layouts[my_cur_page->layout]->windows[cur].font_sz,
                         layouts[my_cur_page->layout]->windows[cur].font_sz);
+                VFD_reverse(my_state[cur].stale);
                 VFD_write_string(my_state[ cur ].text_buffer);
+                VFD_reverse(false);
 #endif
                 break;
             }
@@ -621,6 +881,7 @@ process_hud_data(void)
 {
     uint8_t i;
     char temp_buffer[HUD_DATA_LEN];
+    char const *str;
 
     /*
      * Check if there are any changes in the HUD data module. If any data has
@@ -634,10 +895,26 @@ process_hud_data(void)
                 my_state[i].updated = true;
                 strcpy(my_state[i].text_buffer, temp_buffer);
             }
-        } else if (!HUD_data_valid(my_cur_page->data[i]) && my_state[i].valid) {
-            strcpy(my_state[i].text_buffer, invalid_data_str);
+        } else if (!HUD_data_valid(my_cur_page->data[i])) {
+            /*
+             * Items whose PIDs didn't fit in the schedule will never get a
+             * value, so say so rather than showing them as missing
+             */
+            str = HUD_data_unavail(my_cur_page->data[i]) ? unavail_data_str :
+                invalid_data_str;
+
+            if (strcmp(str, my_state[i].text_buffer) != 0) {
+                strcpy(my_state[i].text_buffer, str);
+                my_state[i].updated = true;
+            }
+        }
+
+        /*
+         * Stale values are shown reversed
+         */
+        if (my_state[i].stale != HUD_data_stale(my_cur_page->data[i])) {
+            my_state[i].stale = !my_state[i].stale;
             my_state[i].updated = true;
-            my_state[i].valid = false;
         }
     }
 }
@@ -733,11 +1010,11 @@ main_loop(void)
 
         HUD_data_init();
 
-        my_connected = true;
+        my_link_state = ELM327_LINK_UP;
         my_searching = false;
         my_last_updt = 0;
 
-        LED_strobe(LED_STATUS, 500);
+        set_status_led();
 
         change_layout();
 
@@ -769,6 +1046,7 @@ main_loop(void)
     /*
      * Enter low power mode
      */
+    TRIP_save();
     destroy_layout();
     low_power_mode();
     }
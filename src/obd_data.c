@@ -19,239 +19,521 @@
  * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
  * IN THE SOFTWARE.
  */
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
 #include <stdlib.h>
 
 #include "elm327.h"
 #include "obd_data.h"
+#include "shift.h"
+#include "timer.h"
 #include "utl.h"
 
-#define RPM_ROUND (100 * 4)
-#define SPEED_HYST (2)
+/*
+ * PIDs that answer NO DATA are backed off so they are polled less often.
+ * Backoff is tracked in ticks of 256 ms, doubling with each consecutive NO
+ * DATA up to 2^NO_DATA_MAX_SHIFT ticks (~16 seconds)
+ */
+#define NO_DATA_TICK_SHIFT (8)
+#define NO_DATA_MAX_SHIFT (6)
+
+#define get_tick() ((uint8_t)(timer_get() >> NO_DATA_TICK_SHIFT))
 
-typedef void (*data_proc_type)(uint8_t const *data, uint8_t len);
+/*
+ * Descriptor flags
+ */
+#define DESC_SIGNED     (0x01)  /* Raw value is two's complement */
 
+#define NO_SLOT (0xFF)
+
+/*
+ * Describes how to decode a PID. The raw value is the first len bytes of the
+ * response, big endian (i.e. A, or A * 256 + B). The decoded value is:
+ *
+ *      raw * num / den + offset
+ */
+struct pid_desc_type {
+    obd_pid_t8 pid;
+    uint8_t len;
+    uint8_t flags;
+    uint8_t num;
+    uint8_t den;
+    int8_t offset;
+};
+
+/*
+ * A point on the speed calibration curve. A reported speed of in_spd is
+ * corrected to out_spd (both in kph)
+ */
 struct speed_cal_type {
     uint8_t in_spd;
     uint8_t out_spd;
 };
 
-static uint8_t my_engn_load;
-static int16_t my_engn_clnt_temp;
-static uint8_t my_uncal_speed;
-static uint8_t my_speed;
-static float my_MAF_rate;
-static uint16_t my_rpm;
-static uint8_t my_fuel_lvl;
-static uint8_t my_baro_pres;
-static int16_t my_air_temp;
-static uint8_t my_intake_manifold_pres;
-static int16_t my_engn_oil_temp;
+/*
+ * Decoded value and polling state for each PID that has a descriptor. The
+ * index of the descriptor is the index of the slot. time is when the value
+ * was received, in milliseconds. Each slot is 11 bytes, so RAM grows with the
+ * number of descriptors rather than with OBD_PID_CNT
+ */
+struct pid_slot_type {
+    int32_t value;
+    uint32_t time;
+    bool valid;
+    uint8_t no_data_cnt;
+    uint8_t no_data_tick;
+};
+
+/*
+ * Must be sorted by PID
+ */
+static const struct pid_desc_type pid_descs[] PROGMEM = {
+    /*  PID                         Len Flags           Num Den Offset  */
+    {   OBD_PID_ENGN_LOAD,          1,  0,              100,255,0       },
+    {   OBD_PID_ENGN_CLNT_TEMP,     1,  0,              1,  1,  -40     },
+    {   OBD_PID_SHORT_FUEL_TRIM_1,  1,  0,              100,128,-100    },
+    {   OBD_PID_LONG_FUEL_TRIM_1,   1,  0,              100,128,-100    },
+    {   OBD_PID_INTAKE_ABS_PRES,    1,  0,              1,  1,  0       },
+    {   OBD_PID_ENGN_RPM,           2,  0,              1,  4,  0       },
+    {   OBD_PID_SPEED,              1,  0,              1,  1,  0       },
+    {   OBD_PID_TIMING_ADV,         1,  0,              1,  2,  -64     },
+    {   OBD_PID_INTAKE_AIR_TEMP,    1,  0,              1,  1,  -40     },
+    {   OBD_PID_MAF_RATE,           2,  0,              1,  1,  0       },
+    {   OBD_PID_THROTTLE_POS,       1,  0,              100,255,0       },
+    {   OBD_PID_RUN_TIME,           2,  0,              1,  1,  0       },
+    {   OBD_PID_FUEL_LVL_INPUT,     1,  0,              100,255,0       },
+    {   OBD_PID_BARO_PRES,          1,  0,              1,  1,  0       },
+    {   OBD_PID_AMBIENT_AIR_TEMP,   1,  0,              1,  1,  -40     },
+    {   OBD_PID_ENGN_OIL_TEMP,      1,  0,              1,  1,  -40     },
+    };
+
+static struct pid_slot_type slots[cnt_of_array(pid_descs)];
+
+/*
+ * Speed calibration curve. The points must be sorted by strictly increasing
+ * in_spd, otherwise speed is uncorrected. Defaults to no correction
+ */
+static struct speed_cal_type EEMEM speed_cal_ee_mem[OBD_SPEED_CAL_CNT] = {
+    {   0,      0   },
+    {   36,     36  },
+    {   73,     73  },
+    {   109,    109 },
+    {   146,    146 },
+    {   182,    182 },
+    {   219,    219 },
+    {   255,    255 },
+};
+
+static struct speed_cal_type speed_cal[OBD_SPEED_CAL_CNT];
+static bool speed_cal_valid;
+static uint8_t uncal_speed;
 
-static bool data_valid[ OBD_PID_CNT ];
+STATIC_ASSERT(cnt_of_array(pid_descs) < NO_SLOT);
+
+/*
+ * Finds the slot for a PID with a binary search of the descriptor table.
+ * Returns NO_SLOT if the PID can't be decoded
+ */
+static uint8_t
+find_slot(obd_pid_t8 pid)
+{
+    uint8_t lo = 0;
+    uint8_t hi = cnt_of_array(pid_descs);
+    uint8_t mid;
+    obd_pid_t8 p;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        p = pgm_read_byte(&pid_descs[mid].pid);
+
+        if (p == pid)
+            return mid;
+
+        if (p < pid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NO_SLOT;
+}
+
+/*
+ * Returns the last decoded value of a PID, or 0 if it can't be decoded
+ */
+int32_t
+OBD_get_value(obd_pid_t8 pid)
+{
+    uint8_t s = find_slot(pid);
+
+    if (s == NO_SLOT)
+        return 0;
+
+    return slots[s].value;
+}
 
 uint8_t
 OBD_get_engn_load(void)
 {
-    return my_engn_load;
+    return OBD_get_value(OBD_PID_ENGN_LOAD);
 }
 
 int16_t
 OBD_get_engn_clnt_temp(void)
 {
-    return my_engn_clnt_temp;
+    return OBD_get_value(OBD_PID_ENGN_CLNT_TEMP);
 }
 
 uint16_t
 OBD_get_rpm(void)
 {
-    return my_rpm;
+    return OBD_get_value(OBD_PID_ENGN_RPM);
 }
 
 uint8_t
 OBD_get_speed(void)
 {
-    return my_speed;
+    return OBD_get_value(OBD_PID_SPEED);
 }
 
+/*
+ * Returns the speed as reported by the vehicle, before calibration
+ */
 uint8_t
 OBD_get_uncal_speed(void)
 {
-    return my_uncal_speed;
+    return uncal_speed;
 }
 
-float
+/*
+ * Returns the mass air flow rate in 0.01 g/s
+ */
+uint16_t
 OBD_get_MAF_rate(void)
 {
-    return my_MAF_rate;
+    return OBD_get_value(OBD_PID_MAF_RATE);
 }
 
 uint8_t
 OBD_get_fuel_lvl(void)
 {
-    return my_fuel_lvl;
+    return OBD_get_value(OBD_PID_FUEL_LVL_INPUT);
 }
 
 uint8_t
 OBD_get_baro_pres(void)
 {
-    return my_baro_pres;
+    return OBD_get_value(OBD_PID_BARO_PRES);
 }
 
 int16_t
 OBD_get_air_temp(void)
 {
-    return my_air_temp;
+    return OBD_get_value(OBD_PID_AMBIENT_AIR_TEMP);
 }
 
 uint8_t
 OBD_get_intake_manifold_pres(void)
 {
-    return my_intake_manifold_pres;
+    return OBD_get_value(OBD_PID_INTAKE_ABS_PRES);
 }
 
 int16_t
 OBD_get_engn_oil_temp(void)
 {
-    return my_engn_oil_temp;
+    return OBD_get_value(OBD_PID_ENGN_OIL_TEMP);
 }
 
-bool
-OBD_is_valid(obd_pid_t8 pid)
+/*
+ * Returns the time the last value of a PID was received, or 0 if one never
+ * was
+ */
+uint32_t
+OBD_get_time(obd_pid_t8 pid)
 {
-    return data_valid[pid];
+    uint8_t s = find_slot(pid);
+
+    if (s == NO_SLOT)
+        return 0;
+
+    return slots[s].time;
 }
 
-static void
-set_engn_load(uint8_t const *data, uint8_t len)
+/*
+ * Returns true if the PID has a descriptor, so its responses can be decoded
+ */
+bool
+OBD_can_decode(obd_pid_t8 pid)
 {
-    if (len < 1)
-        return;
-    my_engn_load = ((uint16_t)data[0] * 100) / 255;
+    return pid < OBD_PID_CNT && find_slot(pid) != NO_SLOT;
 }
 
-static void
-set_engn_clnt_temp(uint8_t const *data, uint8_t len)
+bool
+OBD_is_valid(obd_pid_t8 pid)
 {
-    if (len < 1)
-        return;
-    my_engn_clnt_temp = (int16_t)data[0] - 40;
+    uint8_t s = find_slot(pid);
+
+    return s != NO_SLOT && slots[s].valid;
 }
 
-static void
-set_rpm(uint8_t const *data, uint8_t len)
+/*
+ * Returns false if the PID is backed off because of repeated NO DATA
+ * responses and shouldn't be requested yet
+ */
+bool
+OBD_is_due(obd_pid_t8 pid)
 {
-    if (len < 2)
-        return;
+    uint8_t s;
+    uint8_t backoff;
 
-    my_rpm = ((uint16_t)data[0] << 8) | data[1];
-    my_rpm = my_rpm / (RPM_ROUND / 2);
+    s = find_slot(pid);
 
-    /*
-     * If odd add 1 to round up
-     */
-    if (my_rpm & 0x01)
-        my_rpm += 1;
+    if (s == NO_SLOT || slots[s].no_data_cnt == 0)
+        return true;
 
-    my_rpm *= RPM_ROUND / 2;
-    my_rpm /= 4;
+    backoff = 1 << minval(slots[s].no_data_cnt - 1, NO_DATA_MAX_SHIFT);
+
+    return (uint8_t)(get_tick() - slots[s].no_data_tick) >= backoff;
 }
 
+/*
+ * Loads the speed calibration curve from EEPROM and checks it is sorted
+ */
 static void
-set_speed(uint8_t const *data, uint8_t len)
+load_speed_cal(void)
 {
-    if (len < 1)
-        return;
-    my_speed = data[0];
+    uint8_t i;
+
+    eeprom_read_block(speed_cal, speed_cal_ee_mem, sizeof(speed_cal));
+
+    speed_cal_valid = true;
+
+    for (i = 1; i < OBD_SPEED_CAL_CNT; i++) {
+        if (speed_cal[i].in_spd <= speed_cal[i - 1].in_spd)
+            speed_cal_valid = false;
+    }
 }
 
-static void
-set_MAF_rate(uint8_t const *data, uint8_t len)
+/*
+ * Corrects a reported speed by linear interpolation between the two points of
+ * the calibration curve that it falls between, found with a binary search.
+ * Speeds outside the curve are corrected by the nearest point
+ */
+static uint8_t
+calibrate_speed(uint8_t spd)
 {
-    if (len < 2)
-        return;
-    my_MAF_rate = (((uint16_t)data[0] << 8) | data[1]) / 100.0f;
-}
+    uint8_t lo = 0;
+    uint8_t hi = OBD_SPEED_CAL_CNT - 1;
+    uint8_t mid;
+    int16_t dx;
+    int16_t dy;
+    int32_t v;
 
+    if (!speed_cal_valid)
+        return spd;
 
-static void
-set_fuel_lvl(uint8_t const *data, uint8_t len)
-{
-    if (len < 1)
-        return;
-    my_fuel_lvl = (100 * (uint16_t)data[0]) / 255;
+    if (spd <= speed_cal[lo].in_spd)
+        return speed_cal[lo].out_spd;
+
+    if (spd >= speed_cal[hi].in_spd)
+        return speed_cal[hi].out_spd;
+
+    /*
+     * Find the segment with speed_cal[lo].in_spd < spd <= speed_cal[hi].in_spd
+     */
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+
+        if (speed_cal[mid].in_spd < spd)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    dx = speed_cal[hi].in_spd - speed_cal[lo].in_spd;
+    dy = speed_cal[hi].out_spd - speed_cal[lo].out_spd;
+
+    /*
+     * Round to the nearest kph
+     */
+    v = (int32_t)(spd - speed_cal[lo].in_spd) * dy * 2;
+    v = (v + (v >= 0 ? dx : -dx)) / (dx * 2);
+
+    return speed_cal[lo].out_spd + v;
 }
 
-static void
-set_baro_pres(uint8_t const *data, uint8_t len)
+/*
+ * Sets a point of the speed calibration curve. Returns false if the curve
+ * isn't valid, in which case speed is uncorrected until it is fixed
+ */
+bool
+OBD_set_speed_cal(uint8_t i, uint8_t in_spd, uint8_t out_spd)
 {
-    if (len < 1)
-        return;
-    my_baro_pres = data[0];
+    if (i >= OBD_SPEED_CAL_CNT)
+        return false;
+
+    eeprom_update_byte(&speed_cal_ee_mem[i].in_spd, in_spd);
+    eeprom_update_byte(&speed_cal_ee_mem[i].out_spd, out_spd);
+
+    load_speed_cal();
+
+    return speed_cal_valid;
 }
 
-static void
-set_air_temp(uint8_t const *data, uint8_t len)
+/*
+ * Replaces the speed calibration curve with a straight line that corrects
+ * speed by a percentage. The points are spread evenly over the range of
+ * speeds
+ */
+void
+OBD_set_speed_scale(int8_t pct)
 {
-    if (len < 1)
-        return;
-    my_air_temp = ((int16_t)data[0]) - 40;
+    uint8_t i;
+    uint8_t in_spd;
+    int16_t out_spd;
+
+    for (i = 0; i < OBD_SPEED_CAL_CNT; i++) {
+        in_spd = (i * 255u + (OBD_SPEED_CAL_CNT - 1) / 2) /
+            (OBD_SPEED_CAL_CNT - 1);
+        out_spd = ((int32_t)in_spd * (100 + pct) + 50) / 100;
+
+        eeprom_update_byte(&speed_cal_ee_mem[i].in_spd, in_spd);
+        eeprom_update_byte(&speed_cal_ee_mem[i].out_spd,
+                minval(maxval(out_spd, 0), UINT8_MAX));
+    }
+
+    load_speed_cal();
 }
 
-static void
-set_intake_manifold_pres(uint8_t const *data, uint8_t len)
+/*
+ * Gets the correction of the calibration curve as a percentage, which is the
+ * whole correction if it was set with OBD_set_speed_scale(). It is measured at
+ * the fastest point that isn't limited to the maximum speed
+ */
+int8_t
+OBD_get_speed_scale(void)
 {
-    if (len < 1)
-        return;
-    my_intake_manifold_pres = data[0];
+    uint8_t i;
+    int16_t d;
+    uint8_t in_spd;
+
+    if (!speed_cal_valid)
+        return 0;
+
+    for (i = OBD_SPEED_CAL_CNT - 1; i > 0 &&
+            speed_cal[i].out_spd == UINT8_MAX; i--)
+        ;
+
+    in_spd = speed_cal[i].in_spd;
+    if (!in_spd)
+        return 0;
+
+    d = ((int16_t)speed_cal[i].out_spd - in_spd) * 100;
+    return (d + (d >= 0 ? in_spd / 2 : -(in_spd / 2))) / in_spd;
 }
 
-static void
-set_engn_oil_temp(uint8_t const *data, uint8_t len)
+/*
+ * Decodes a response using the PID's descriptor. Returns the number of bytes
+ * of data used, or 0 if there wasn't enough
+ */
+static uint8_t
+decode(uint8_t s, uint8_t const *data, uint8_t len)
 {
-    if (len < 1)
-        return;
-    my_engn_oil_temp = (int16_t)data[0] - 40;
-}
+    struct pid_desc_type desc;
+    int32_t raw;
+
+    memcpy_P(&desc, &pid_descs[s], sizeof(desc));
+
+    if (len < desc.len)
+        return 0;
+
+    if (desc.len == 2) {
+        raw = ((uint16_t)data[0] << 8) | data[1];
+        if (desc.flags & DESC_SIGNED)
+            raw = (int16_t)raw;
+    } else {
+        raw = data[0];
+        if (desc.flags & DESC_SIGNED)
+            raw = (int8_t)raw;
+    }
 
-static const data_proc_type data_procs[OBD_PID_CNT] = {
-    [OBD_PID_ENGN_LOAD] = set_engn_load,
-    [OBD_PID_ENGN_CLNT_TEMP] = set_engn_clnt_temp,
-    [OBD_PID_INTAKE_ABS_PRES] = set_intake_manifold_pres,
-    [OBD_PID_ENGN_RPM] = set_rpm,
-    [OBD_PID_SPEED] = set_speed,
-    [OBD_PID_MAF_RATE ] = set_MAF_rate,
-    [OBD_PID_FUEL_LVL_INPUT] = set_fuel_lvl,
-    [OBD_PID_BARO_PRES] =  set_baro_pres,
-    [OBD_PID_AMBIENT_AIR_TEMP] = set_air_temp,
-    [OBD_PID_ENGN_OIL_TEMP] = set_engn_oil_temp,
-    };
+    slots[s].value = raw * desc.num / desc.den + desc.offset;
+
+    /*
+     * Everything that uses speed sees the calibrated value
+     */
+    if (desc.pid == OBD_PID_SPEED) {
+        uncal_speed = slots[s].value;
+        slots[s].value = calibrate_speed(uncal_speed);
+    }
+
+    return desc.len;
+}
 
+/*
+ * The response to a multi-PID request has the data of each PID followed by
+ * the next PID. Every value in a response gets the same timestamp, so values
+ * that are used together can be matched up
+ */
 static void
 data_clbk(obd_pid_t8 pid, uint8_t const *data, uint8_t len)
 {
-    if (pid < OBD_PID_CNT && data_procs[pid]) {
-        data_procs[pid](data, len);
-        data_valid[pid] = true;
+    uint32_t now = timer_get();
+    uint8_t s;
+    uint8_t used;
+
+    while ((s = find_slot(pid)) != NO_SLOT && (used = decode(s, data, len))) {
+        slots[s].time = now;
+        slots[s].valid = true;
+        slots[s].no_data_cnt = 0;
+
+        /*
+         * The shift light is updated here rather than when the display is,
+         * to keep its latency down
+         */
+        if (pid == OBD_PID_ENGN_RPM)
+            SHIFT_add_rpm(slots[s].value, now);
+
+        if (len < used + 2)
+            break;
+
+        pid = data[used];
+        data += used + 1;
+        len -= used + 1;
     }
 }
 
 static void
 no_data_clbk(obd_pid_t8 pid)
 {
-    if (pid < OBD_PID_CNT)
-        data_valid[pid] = false;
+    uint8_t s = find_slot(pid);
+
+    if (s != NO_SLOT) {
+        slots[s].valid = false;
+
+        if (slots[s].no_data_cnt <= NO_DATA_MAX_SHIFT)
+            slots[s].no_data_cnt++;
+
+        slots[s].no_data_tick = get_tick();
+    }
 }
 
 
 void
 OBD_data_init(void)
 {
-    obd_pid_t8 i;
+    uint8_t i;
 
     ELM327_set_echo(false);
     ELM327_set_clbk(data_clbk, no_data_clbk);
 
-    for (i = 0; i < OBD_PID_CNT; i++)
-        data_valid[i] = false;
-}
+    for (i = 0; i < cnt_of_array(slots); i++) {
+        slots[i].value = 0;
+        slots[i].time = 0;
+        slots[i].valid = false;
+        slots[i].no_data_cnt = 0;
+    }
 
+    uncal_speed = 0;
+    load_speed_cal();
+}
@@ -27,9 +27,17 @@
 
 #include "obd_pid.h"
 
+/*
+ * Number of points in the speed calibration curve
+ */
+#define OBD_SPEED_CAL_CNT (8)
+
 void
 OBD_data_init(void);
 
+int32_t
+OBD_get_value(obd_pid_t8 pid);
+
 uint8_t
 OBD_get_engn_load(void);
 
@@ -45,7 +53,7 @@ OBD_get_speed(void);
 uint8_t
 OBD_get_uncal_speed(void);
 
-float
+uint16_t
 OBD_get_MAF_rate(void);
 
 uint8_t
@@ -63,7 +71,25 @@ OBD_get_intake_manifold_pres(void);
 int16_t
 OBD_get_engn_oil_temp(void);
 
+bool
+OBD_set_speed_cal(uint8_t i, uint8_t in_spd, uint8_t out_spd);
+
+void
+OBD_set_speed_scale(int8_t pct);
+
+int8_t
+OBD_get_speed_scale(void);
+
+uint32_t
+OBD_get_time(obd_pid_t8 pid);
+
+bool
+OBD_can_decode(obd_pid_t8 pid);
+
 bool
 OBD_is_valid(obd_pid_t8 pid);
 
+bool
+OBD_is_due(obd_pid_t8 pid);
+
 #endif /* _OBD_DATA_H_ */
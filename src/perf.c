@@ -0,0 +1,205 @@
+/*
+ * Copyright 2017 Joshua Watt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <avr/io.h>
+#include <stdlib.h>
+
+#include "perf.h"
+#include "utl.h"
+
+/*
+ * Times a performance run from standstill. Once armed, the run starts with
+ * the first non-zero speed sample after a sample at standstill, and is timed
+ * from that standstill sample. Each mark is timed by linearly interpolating
+ * between the two samples either side of it, so the accuracy of a run depends
+ * on the sample interval, which is reported with the times.
+ *
+ * Speeds are in 0.01 kph. Distance is integrated from speed with the
+ * trapezoidal rule in kph * ms, which is 1/3600 of a meter
+ */
+#define QTR_MILE_DIST (1448410ul)   /* 402.336 m */
+
+/*
+ * A run that hasn't reached every mark after this many milliseconds ends
+ */
+#define MAX_RUN_TIME (60000ul)
+
+static const uint16_t speed_marks[] = {
+    [PERF_60_MPH]   = 9656,     /* 96.56 kph */
+    [PERF_100_KPH]  = 10000,
+};
+
+STATIC_ASSERT(cnt_of_array(speed_marks) == PERF_QTR_MILE);
+
+static struct {
+    perf_state_t8 state;
+    bool stopped;
+    uint8_t speed;
+    uint32_t time;
+    uint32_t start;
+    uint32_t dist;
+    uint16_t cnt;
+    uint8_t done;
+    uint32_t marks[PERF_MARK_CNT];
+} run;
+
+void
+PERF_arm(void)
+{
+    run.state = PERF_ARMED;
+    run.stopped = false;
+    run.done = 0;
+    run.cnt = 0;
+}
+
+/*
+ * Checks if the latest sample passed any of the marks, and records when
+ */
+static void
+check_marks(uint8_t speed, uint32_t time, uint32_t prev_dist)
+{
+    perf_mark_t8 m;
+    uint32_t dt = time - run.time;
+    uint16_t v0 = run.speed * 100;
+    uint16_t v1 = speed * 100;
+
+    for (m = 0; m < cnt_of_array(speed_marks); m++) {
+        if ((run.done & _BV(m)) || v1 < speed_marks[m])
+            continue;
+
+        run.marks[m] = run.time - run.start +
+            dt * (speed_marks[m] - v0) / (v1 - v0);
+        run.done |= _BV(m);
+    }
+
+    if (!(run.done & _BV(PERF_QTR_MILE)) && run.dist >= QTR_MILE_DIST) {
+        run.marks[PERF_QTR_MILE] = run.time - run.start +
+            (uint64_t)dt * (QTR_MILE_DIST - prev_dist) /
+            (run.dist - prev_dist);
+        run.done |= _BV(PERF_QTR_MILE);
+    }
+}
+
+/*
+ * Adds a speed sample (in kph) taken at a time in milliseconds
+ */
+void
+PERF_add_speed(uint8_t speed, uint32_t time)
+{
+    uint32_t prev_dist;
+
+    switch (run.state) {
+    case PERF_ARMED:
+        if (speed == 0) {
+            run.stopped = true;
+            break;
+        }
+
+        if (!run.stopped)
+            break;
+
+        run.state = PERF_RUNNING;
+        run.start = run.time;
+        run.dist = 0;
+        run.cnt = 1;
+        /* Fall through */
+
+    case PERF_RUNNING:
+        if (speed == 0) {
+            /*
+             * Stopped before the end of the run. Wait for the next launch
+             */
+            run.state = PERF_ARMED;
+            run.done = 0;
+            run.cnt = 0;
+            break;
+        }
+
+        prev_dist = run.dist;
+        run.dist += (uint32_t)(run.speed + speed) * (time - run.time) / 2;
+        check_marks(speed, time, prev_dist);
+
+        if (run.cnt < UINT16_MAX)
+            run.cnt++;
+
+        if (run.done == _BV(PERF_MARK_CNT) - 1 ||
+                time - run.start >= MAX_RUN_TIME)
+            run.state = PERF_DONE;
+        break;
+
+    default:
+        return;
+    }
+
+    run.speed = speed;
+    run.time = time;
+}
+
+perf_state_t8
+PERF_get_state(void)
+{
+    return run.state;
+}
+
+/*
+ * Returns true while speed should be sampled as fast as possible
+ */
+bool
+PERF_is_armed(void)
+{
+    return run.state == PERF_ARMED || run.state == PERF_RUNNING;
+}
+
+/*
+ * Gets the time in milliseconds from the start of the run to a mark. Returns
+ * false if the mark hasn't been reached
+ */
+bool
+PERF_get_time(perf_mark_t8 m, uint32_t *time)
+{
+    if (!(run.done & _BV(m)))
+        return false;
+
+    *time = run.marks[m];
+    return true;
+}
+
+/*
+ * Gets the average interval between the speed samples of the run, in
+ * milliseconds
+ */
+bool
+PERF_get_smp_intvl(uint16_t *intvl)
+{
+    if (run.cnt < 2)
+        return false;
+
+    *intvl = minval((run.time - run.start) / (run.cnt - 1), UINT16_MAX);
+    return true;
+}
+
+void
+PERF_init(void)
+{
+    run.state = PERF_IDLE;
+    run.done = 0;
+    run.cnt = 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2017 Joshua Watt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _PERF_H_
+#define _PERF_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint8_t perf_state_t8; enum {
+    PERF_IDLE,
+    PERF_ARMED,
+    PERF_RUNNING,
+    PERF_DONE,
+};
+
+/*
+ * Points of a run that are timed
+ */
+typedef uint8_t perf_mark_t8; enum {
+    PERF_60_MPH,
+    PERF_100_KPH,
+    PERF_QTR_MILE,
+
+    PERF_MARK_CNT
+};
+
+void
+PERF_init(void);
+
+void
+PERF_arm(void);
+
+void
+PERF_add_speed(uint8_t speed, uint32_t time);
+
+perf_state_t8
+PERF_get_state(void);
+
+bool
+PERF_is_armed(void);
+
+bool
+PERF_get_time(perf_mark_t8 m, uint32_t *time);
+
+bool
+PERF_get_smp_intvl(uint16_t *intvl);
+
+#endif /* _PERF_H_ */
@@ -51,6 +51,21 @@ queue_is_full(struct queue const *queue)
     return queue_next(queue, queue->head) == queue->tail;
 }
 
+/*
+ * Returns the number of bytes that can be pushed before the queue is full
+ */
+size_t
+queue_free(struct queue const *queue)
+{
+    size_t head = queue->head;
+    size_t tail = queue->tail;
+
+    if (head >= tail)
+        return queue->size - 1 - (head - tail);
+
+    return tail - head - 1;
+}
+
 size_t
 queue_push(struct queue *queue, void const *ptr, size_t len)
 {
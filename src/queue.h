@@ -42,6 +42,9 @@ queue_is_empty(struct queue const *queue);
 bool
 queue_is_full(struct queue const *queue);
 
+size_t
+queue_free(struct queue const *queue);
+
 size_t
 queue_push(struct queue *queue, void const *ptr, size_t len);
 
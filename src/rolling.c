@@ -0,0 +1,212 @@
+/*
+ * Copyright 2017 Joshua Watt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+
+#include "rolling.h"
+#include "timer.h"
+#include "trip.h"
+#include "utl.h"
+
+/*
+ * Rolling windows are made up of fixed length buckets. The current bucket is
+ * still accumulating, so a window is the current bucket plus enough closed
+ * buckets to make up the rest of its length
+ */
+#define BUCKET_LEN (30ul * 1000ul)
+#define BUCKETS_PER_MIN (2)
+#define MAX_WINDOW_MIN (15)
+#define BUCKET_CNT (MAX_WINDOW_MIN * BUCKETS_PER_MIN - 1)
+
+/*
+ * Engine load is integrated with the trapezoid rule, with gaps longer than
+ * TRIP_MAX_SAMPLE_GAP only counted up to that length. The area is doubled
+ * because the trapezoid sums two samples
+ */
+#define LOAD_AREA_SHIFT (8 + 1)
+
+/*
+ * Fuel is stored in buckets in units of 2^FUEL_SHIFT mg
+ */
+#define FUEL_SHIFT (6)
+
+/*
+ * Distance and fuel come from the trip totals, so they are integrated in
+ * exactly one place. Each bucket holds what was added to the totals while it
+ * was current
+ */
+struct bucket_type {
+    uint16_t dist;      /* meters */
+    uint16_t fuel;      /* 2^FUEL_SHIFT mg */
+    uint16_t time;      /* ms */
+    uint16_t load;      /* % * 256 ms */
+    uint16_t load_time; /* ms */
+};
+
+static const uint8_t win_min[ROLLING_WIN_CNT] = {
+    [ROLLING_1_MIN]     = 1,
+    [ROLLING_5_MIN]     = 5,
+    [ROLLING_15_MIN]    = 15,
+};
+
+static struct bucket_type buckets[BUCKET_CNT];
+static uint8_t head;
+static uint8_t bucket_cnt;
+static uint32_t bucket_start;
+
+/*
+ * Trip totals when the current bucket started
+ */
+static uint32_t start_dist;
+static uint32_t start_fuel;
+static uint32_t start_time;
+
+/*
+ * Engine load accumulated in the current bucket, in % * ms * 2
+ */
+static uint32_t load_area;
+static uint32_t load_time;
+static bool last_load_valid;
+static uint8_t last_load;
+static uint32_t last_load_time;
+
+STATIC_ASSERT(BUCKET_CNT < UINT8_MAX);
+
+/*
+ * Returns how much a trip total has grown since the current bucket started.
+ * The trip can be reset while a bucket is current, in which case it counts
+ * from 0
+ */
+static uint32_t
+trip_delta(uint32_t *start, uint32_t total)
+{
+    if (total < *start)
+        *start = 0;
+
+    return total - *start;
+}
+
+void
+ROLLING_add_load(uint8_t load, uint32_t time)
+{
+    uint16_t dt;
+
+    if (last_load_valid) {
+        dt = minval(time - last_load_time, TRIP_MAX_SAMPLE_GAP);
+        load_area += ((uint32_t)last_load + load) * dt;
+        load_time += dt;
+    }
+
+    last_load_valid = true;
+    last_load = load;
+    last_load_time = time;
+}
+
+/*
+ * Closes the current bucket and starts a new one. Anything that doesn't fit
+ * in the bucket (including fractions of its units) is carried into the new
+ * bucket
+ */
+static void
+close_bucket(void)
+{
+    struct bucket_type *b = &buckets[head];
+
+    b->dist = minval(trip_delta(&start_dist, TRIP_get_dist()), UINT16_MAX);
+    b->fuel = minval(trip_delta(&start_fuel, TRIP_get_fuel()) >> FUEL_SHIFT,
+            UINT16_MAX);
+    b->time = minval(trip_delta(&start_time, TRIP_get_time()), UINT16_MAX);
+    b->load = minval(load_area >> LOAD_AREA_SHIFT, UINT16_MAX);
+    b->load_time = minval(load_time, UINT16_MAX);
+
+    start_dist += b->dist;
+    start_fuel += (uint32_t)b->fuel << FUEL_SHIFT;
+    start_time += b->time;
+    load_area -= (uint32_t)b->load << LOAD_AREA_SHIFT;
+    load_time -= b->load_time;
+
+    head = (head + 1) % BUCKET_CNT;
+    if (bucket_cnt < BUCKET_CNT)
+        bucket_cnt++;
+}
+
+/*
+ * Sums the current bucket and the closed buckets that make up a window. The
+ * window is shorter than requested until enough buckets have been closed
+ */
+void
+ROLLING_get(rolling_win_t8 w, struct rolling_sums *sums)
+{
+    uint8_t cnt;
+    uint8_t i;
+    struct bucket_type const *b;
+
+    sums->dist = trip_delta(&start_dist, TRIP_get_dist());
+    sums->fuel = trip_delta(&start_fuel, TRIP_get_fuel());
+    sums->time = trip_delta(&start_time, TRIP_get_time());
+    sums->load = load_area >> LOAD_AREA_SHIFT;
+    sums->load_time = load_time;
+
+    cnt = minval(win_min[w] * BUCKETS_PER_MIN - 1, bucket_cnt);
+
+    for (i = 1; i <= cnt; i++) {
+        b = &buckets[(head + BUCKET_CNT - i) % BUCKET_CNT];
+
+        sums->dist += b->dist;
+        sums->fuel += (uint32_t)b->fuel << FUEL_SHIFT;
+        sums->time += b->time;
+        sums->load += b->load;
+        sums->load_time += b->load_time;
+    }
+}
+
+void
+ROLLING_process(void)
+{
+    if (timer_get() - bucket_start < BUCKET_LEN)
+        return;
+
+    close_bucket();
+
+    /*
+     * Don't try to catch up on buckets that were missed (e.g. while in a
+     * menu); their time is in the bucket that was just closed
+     */
+    bucket_start += BUCKET_LEN;
+    if (timer_get() - bucket_start >= BUCKET_LEN)
+        bucket_start = timer_get();
+}
+
+void
+ROLLING_init(void)
+{
+    head = 0;
+    bucket_cnt = 0;
+    bucket_start = timer_get();
+
+    start_dist = TRIP_get_dist();
+    start_fuel = TRIP_get_fuel();
+    start_time = TRIP_get_time();
+
+    load_area = 0;
+    load_time = 0;
+    last_load_valid = false;
+}
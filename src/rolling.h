@@ -0,0 +1,60 @@
+/*
+ * Copyright 2017 Joshua Watt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _ROLLING_H_
+#define _ROLLING_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint8_t rolling_win_t8; enum {
+    ROLLING_1_MIN,
+    ROLLING_5_MIN,
+    ROLLING_15_MIN,
+
+    ROLLING_WIN_CNT
+};
+
+/*
+ * Totals over a rolling window. time is the time that speed and fuel were
+ * sampled for, and load_time the time that engine load was sampled for
+ */
+struct rolling_sums {
+    uint32_t dist;      /* meters */
+    uint32_t fuel;      /* mg */
+    uint32_t time;      /* ms */
+    uint32_t load;      /* % * 256 ms */
+    uint32_t load_time; /* ms */
+};
+
+void
+ROLLING_init(void);
+
+void
+ROLLING_add_load(uint8_t load, uint32_t time);
+
+void
+ROLLING_get(rolling_win_t8 w, struct rolling_sums *sums);
+
+void
+ROLLING_process(void);
+
+#endif /* _ROLLING_H_ */
@@ -0,0 +1,177 @@
+/*
+ * Copyright 2017 Joshua Watt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <avr/eeprom.h>
+#include <avr/io.h>
+#include <stdlib.h>
+
+#include "elm327.h"
+#include "led.h"
+#include "shift.h"
+#include "utl.h"
+
+/*
+ * The shift light is the status LED. It is driven straight from the decode of
+ * each RPM response, so the only latency it adds to the bus is the time taken
+ * to decode the response.
+ *
+ * Polling hides when RPM actually crosses the threshold, so the crossing is
+ * predicted from the slope between the last two samples. A sample is taken
+ * by the ECU roughly half way through its request, so it is already half the
+ * request latency old when it is decoded. If RPM will cross the threshold
+ * before the next sample arrives, the LED is timed to come on at the crossing.
+ * The timed crossing is cancelled if the next sample no longer predicts it.
+ *
+ * The LED goes off when RPM falls SHIFT_HYST below the threshold
+ */
+#define SHIFT_HYST (200)
+
+/*
+ * The request latency is a moving average weighted 1/(1 << LATENCY_SHIFT)
+ * to the newest sample, kept with LATENCY_SHIFT fractional bits
+ */
+#define LATENCY_SHIFT (3)
+
+/*
+ * EEPROM Variables
+ */
+static uint16_t EEMEM shift_rpm_eemem = 0;
+
+static uint16_t shift_rpm;
+static bool lit;
+static bool pending;
+static bool have_last;
+static uint16_t last_rpm;
+static uint32_t last_time;
+static uint16_t latency;
+
+/*
+ * Sets the LED, cancelling any predicted crossing
+ */
+static void
+set_lit(bool on)
+{
+    if (on == lit && !pending)
+        return;
+
+    lit = on;
+    pending = false;
+    LED_set(LED_STATUS, on);
+}
+
+/*
+ * Adds an RPM sample decoded at a time in milliseconds. A threshold of 0
+ * disables the shift light
+ */
+void
+SHIFT_add_rpm(uint16_t rpm, uint32_t time)
+{
+    uint16_t dt;
+    uint32_t lead;
+    uint16_t age;
+    uint16_t l;
+
+    if (!shift_rpm)
+        return;
+
+    l = minval(time - ELM327_get_rqst_time(), UINT16_MAX >> LATENCY_SHIFT);
+    if (have_last)
+        latency += l - (latency >> LATENCY_SHIFT);
+    else
+        latency = l << LATENCY_SHIFT;
+
+    dt = minval(time - last_time, UINT16_MAX);
+    age = latency >> (LATENCY_SHIFT + 1);
+    lead = UINT32_MAX;
+
+    if (have_last && rpm < shift_rpm && rpm > last_rpm && dt)
+        lead = (uint32_t)(shift_rpm - rpm) * dt / (rpm - last_rpm);
+
+    if (rpm >= shift_rpm || lead <= age) {
+        set_lit(true);
+    } else if (lead - age <= dt) {
+        if (!lit) {
+            pending = true;
+            LED_delay_on(LED_STATUS, lead - age);
+        }
+    } else if (rpm + SHIFT_HYST < shift_rpm || pending) {
+        set_lit(false);
+    }
+
+    last_rpm = rpm;
+    last_time = time;
+    have_last = true;
+}
+
+/*
+ * Turns the shift light off, for when the status LED is taken back from
+ * another use
+ */
+void
+SHIFT_reset(void)
+{
+    lit = false;
+    pending = false;
+    LED_off(LED_STATUS);
+}
+
+void
+SHIFT_set_rpm(uint16_t rpm)
+{
+    eeprom_update_word(&shift_rpm_eemem, rpm);
+    shift_rpm = rpm;
+
+    if (!rpm)
+        set_lit(false);
+}
+
+/*
+ * Returns the shift light threshold in RPM, or 0 if it is disabled
+ */
+uint16_t
+SHIFT_get_rpm(void)
+{
+    return shift_rpm;
+}
+
+/*
+ * Gets the average time from an RPM request being sent to the shift light
+ * being updated from its response, in milliseconds
+ */
+bool
+SHIFT_get_latency(uint16_t *l)
+{
+    if (!have_last)
+        return false;
+
+    *l = (latency + _BV(LATENCY_SHIFT - 1)) >> LATENCY_SHIFT;
+    return true;
+}
+
+void
+SHIFT_init(void)
+{
+    shift_rpm = eeprom_read_word(&shift_rpm_eemem);
+    lit = false;
+    pending = false;
+    have_last = false;
+    latency = 0;
+}
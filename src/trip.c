@@ -0,0 +1,235 @@
+/*
+ * Copyright 2017 Joshua Watt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <avr/eeprom.h>
+#include <stdlib.h>
+
+#include "journal.h"
+#include "timer.h"
+#include "trip.h"
+#include "utl.h"
+
+/*
+ * Distance and fuel are integrated over time using the trapezoid rule
+ * between consecutive samples. Gaps longer than TRIP_MAX_SAMPLE_GAP (e.g.
+ * when the link was down) are only counted up to that length
+ */
+
+/*
+ * kph * ms in a meter, doubled because the trapezoid sums two samples
+ */
+#define DIST_DIV (2ul * 3600ul)
+
+/*
+ * (0.01 g/s of air) * ms in a mg of fuel, at the ideal 14.7:1 air/fuel ratio,
+ * doubled because the trapezoid sums two samples
+ */
+#define FUEL_DIV (2ul * 1470ul)
+
+/*
+ * Save the trip every minute. The journal spreads the writes over
+ * TRIP_JOURNAL_CNT records, so each EEPROM cell is only written about every
+ * half hour
+ */
+#define TRIP_WRITE_INTVL (60l * 1000l)
+#define TRIP_JOURNAL_CNT (32)
+
+struct trip_type {
+    uint32_t dist;      /* meters */
+    uint32_t fuel;      /* mg */
+    uint32_t time;      /* ms */
+};
+
+struct sample_type {
+    bool valid;
+    uint16_t value;
+    uint32_t time;
+};
+
+STATIC_ASSERT(sizeof(struct trip_type) <= JOURNAL_MAX_DATA);
+
+/*
+ * EEPROM Varaibles
+ */
+static uint8_t EEMEM
+    trip_ee_mem[TRIP_JOURNAL_CNT][JOURNAL_REC_SZ(sizeof(struct trip_type))];
+
+static struct trip_type my_trip;
+static uint16_t dist_rem;
+static uint16_t fuel_rem;
+static struct sample_type last_speed;
+static struct sample_type last_MAF_rate;
+
+static struct journal trip_journal;
+static bool trip_updated;
+static struct timer trip_timer;
+static uint32_t trip_num_writes;
+
+/*
+ * Integrates a new sample against the previous one. Returns the area under
+ * the line between them (sum of the samples * ms), and the elapsed time in
+ * dt
+ */
+static uint32_t
+integrate(struct sample_type *last, uint16_t value, uint32_t time,
+        uint16_t *dt)
+{
+    uint32_t area = 0;
+
+    *dt = 0;
+
+    if (last->valid) {
+        *dt = minval(time - last->time, TRIP_MAX_SAMPLE_GAP);
+        area = ((uint32_t)last->value + value) * *dt;
+    }
+
+    last->valid = true;
+    last->value = value;
+    last->time = time;
+
+    return area;
+}
+
+void
+TRIP_add_speed(uint8_t kph, uint32_t time)
+{
+    uint32_t area;
+    uint16_t dt;
+
+    area = integrate(&last_speed, kph, time, &dt) + dist_rem;
+
+    my_trip.dist += area / DIST_DIV;
+    dist_rem = area % DIST_DIV;
+    my_trip.time += dt;
+
+    trip_updated = true;
+}
+
+void
+TRIP_add_MAF_rate(uint16_t maf, uint32_t time)
+{
+    uint32_t area;
+    uint16_t dt;
+
+    area = integrate(&last_MAF_rate, maf, time, &dt) + fuel_rem;
+
+    my_trip.fuel += area / FUEL_DIV;
+    fuel_rem = area % FUEL_DIV;
+
+    trip_updated = true;
+}
+
+/*
+ * Returns the trip distance in meters
+ */
+uint32_t
+TRIP_get_dist(void)
+{
+    return my_trip.dist;
+}
+
+/*
+ * Returns the fuel used on the trip in mg
+ */
+uint32_t
+TRIP_get_fuel(void)
+{
+    return my_trip.fuel;
+}
+
+/*
+ * Returns the elapsed trip time in ms
+ */
+uint32_t
+TRIP_get_time(void)
+{
+    return my_trip.time;
+}
+
+uint32_t
+TRIP_get_num_writes(void)
+{
+    return trip_num_writes;
+}
+
+static void
+trip_write_clbk(void *param)
+{
+    if (trip_updated && JOURNAL_write(&trip_journal, &my_trip)) {
+        trip_num_writes++;
+        trip_updated = false;
+    }
+
+    /*
+     * Create the timer for the next write cycle
+     */
+    timer_create(&trip_timer, TRIP_WRITE_INTVL, trip_write_clbk, NULL);
+}
+
+/*
+ * Writes any unsaved trip data, and waits for it to complete. Used before
+ * powering down
+ */
+void
+TRIP_save(void)
+{
+    JOURNAL_flush(&trip_journal);
+    trip_write_clbk(NULL);
+    JOURNAL_flush(&trip_journal);
+}
+
+void
+TRIP_process(void)
+{
+    JOURNAL_process(&trip_journal);
+}
+
+void
+TRIP_reset(void)
+{
+    my_trip.dist = 0;
+    my_trip.fuel = 0;
+    my_trip.time = 0;
+    dist_rem = 0;
+    fuel_rem = 0;
+
+    trip_updated = true;
+    TRIP_save();
+}
+
+void
+TRIP_init(void)
+{
+    my_trip.dist = 0;
+    my_trip.fuel = 0;
+    my_trip.time = 0;
+    dist_rem = 0;
+    fuel_rem = 0;
+    last_speed.valid = false;
+    last_MAF_rate.valid = false;
+    trip_updated = false;
+    trip_num_writes = 0;
+
+    JOURNAL_init(&trip_journal, trip_ee_mem, sizeof(my_trip),
+            cnt_of_array(trip_ee_mem), &my_trip);
+
+    timer_create(&trip_timer, TRIP_WRITE_INTVL, trip_write_clbk, NULL);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2017 Joshua Watt
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _TRIP_H_
+#define _TRIP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Samples further apart than this (in milliseconds) are treated as a gap in
+ * polling, e.g. while the link was down, and only counted up to this length.
+ * PIDs that are integrated must be polled well within it
+ */
+#define TRIP_MAX_SAMPLE_GAP (5000)
+
+void
+TRIP_init(void);
+
+void
+TRIP_add_speed(uint8_t kph, uint32_t time);
+
+void
+TRIP_add_MAF_rate(uint16_t maf, uint32_t time);
+
+uint32_t
+TRIP_get_dist(void);
+
+uint32_t
+TRIP_get_fuel(void);
+
+uint32_t
+TRIP_get_time(void);
+
+uint32_t
+TRIP_get_num_writes(void);
+
+void
+TRIP_reset(void);
+
+void
+TRIP_save(void);
+
+void
+TRIP_process(void);
+
+#endif /* _TRIP_H_ */
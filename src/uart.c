@@ -28,11 +28,13 @@
 #include "led.h"
 #include "pin.h"
 #include "queue.h"
+#include "timer.h"
 #include "uart.h"
 #include "utl.h"
 
 #define TX_BUFFER_SZ (32)
 #define RX_BUFFER_SZ (128)
+#define TRIG_BUFFER_SZ (8)
 
 #define RX_BUFFER_FULL  ((RX_BUFFER_SZ * 3) / 4)
 
@@ -78,6 +80,12 @@ struct uart {
     uint8_t overrun;
     struct pin_change_handler cts_pin;
     bool cts_invert;
+
+    bool trig_enabled;
+    uint8_t trig_byte;
+    volatile uint32_t trig_time;
+    volatile uint8_t trig_len;
+    uint8_t trig_buffer[TRIG_BUFFER_SZ];
 };
 
 static struct uart uart_data[UART_CNT];
@@ -247,6 +255,9 @@ UART_init(uart_dev_t8 dev, uint8_t opts, uint32_t speed)
         uart->tx_pending = false;
         uart->cts_pin.pin = PIN_INVALID;
         uart->cts_invert = false;
+        uart->trig_enabled = false;
+        uart->trig_time = 0;
+        uart->trig_len = 0;
 
         /* Get Control Register Values */
         if (opts & UART_RX)
@@ -335,6 +346,91 @@ UART_set_cts_in(uart_dev_t8 dev, enum pin pin, bool invert)
     pin_enable_interrupt(&uart->cts_pin);
 }
 
+/*
+ * Sets a byte that triggers the transmission of staged data (see
+ * UART_tx_on_trigger()) as soon as it is received. The time the trigger byte
+ * was last received is also recorded
+ */
+void
+UART_set_rx_trigger(uart_dev_t8 dev, uint8_t byte)
+{
+    struct uart *uart = get_uart(dev);
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uart->trig_byte = byte;
+        uart->trig_len = 0;
+        uart->trig_enabled = true;
+    }
+}
+
+uint32_t
+UART_rx_trigger_time(uart_dev_t8 dev)
+{
+    uint32_t ret;
+    struct uart *uart = get_uart(dev);
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ret = uart->trig_time;
+    }
+
+    return ret;
+}
+
+/*
+ * Stages data to be transmitted from the RX interrupt when the trigger byte
+ * is next received. Returns false if the data doesn't fit
+ */
+bool
+UART_tx_on_trigger(uart_dev_t8 dev, void const *data, uint8_t len)
+{
+    struct uart *uart = get_uart(dev);
+
+    if (len > sizeof(uart->trig_buffer))
+        return false;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        memcpy(uart->trig_buffer, data, len);
+        uart->trig_len = len;
+    }
+
+    return true;
+}
+
+/*
+ * Cancels any staged data. Returns true if there was data staged, or false if
+ * the trigger has already sent it
+ */
+bool
+UART_tx_on_trigger_cncl(uart_dev_t8 dev)
+{
+    bool staged;
+    struct uart *uart = get_uart(dev);
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        staged = uart->trig_len != 0;
+        uart->trig_len = 0;
+    }
+
+    return staged;
+}
+
+/*
+ * Sends the staged data when the trigger byte is received. If the whole of it
+ * doesn't fit in the TX queue it is left staged, so cancelling it reports that
+ * it wasn't sent rather than a truncated command going out
+ */
+static void
+process_trigger(struct uart *uart)
+{
+    uart->trig_time = timer_get();
+
+    if (uart->trig_len && queue_free(&uart->tx_queue) >= uart->trig_len) {
+        queue_push(&uart->tx_queue, uart->trig_buffer, uart->trig_len);
+        uart->reg->ucsrb |= _BV(UDRIE0);
+        uart->trig_len = 0;
+    }
+}
+
 static void
 process_rx(uart_dev_t8 dev)
 {
@@ -348,6 +444,9 @@ process_rx(uart_dev_t8 dev)
         uart->rx_dropped++;
     } else {
         queue_push(&uart->rx_queue, &data, 1);
+
+        if (uart->trig_enabled && data == uart->trig_byte)
+            process_trigger(uart);
     }
 
     if (uart->reg->ucsra & _BV(DOR0))
@@ -77,3 +77,15 @@ UART_change_baud(uart_dev_t8 dev, uint32_t speed);
 void
 UART_set_cts_in(uart_dev_t8 dev, enum pin pin, bool invert);
 
+void
+UART_set_rx_trigger(uart_dev_t8 dev, uint8_t byte);
+
+uint32_t
+UART_rx_trigger_time(uart_dev_t8 dev);
+
+bool
+UART_tx_on_trigger(uart_dev_t8 dev, void const *data, uint8_t len);
+
+bool
+UART_tx_on_trigger_cncl(uart_dev_t8 dev);
+